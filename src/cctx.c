@@ -20,8 +20,57 @@
 ** THE SOFTWARE.
 */
 
+#include <string.h>
 #include "common.h"
 
+#define ADAPT_WINDOW (1 << 20) /* Amount of input between adaptive level decisions */
+#if ZSTD_VERSION_NUMBER >= 10505
+#define SEQUENCEBOUND(size) ZSTD_sequenceBound(size)
+#else
+#define SEQUENCEBOUND(size) ((size) / ZSTD_MINMATCH_MIN + (size) / (1 << 10) + 2) /* Upper bound on number of sequences */
+#endif
+
+/* Context workspace can be freed by pool and is recreated lazily */
+CCtx *zstd__checkcctx(lua_State *L, int arg) {
+	CCtx *cctx = luaL_checkudata(L, arg, TYPE_CCTX);
+	luaL_argcheck(L, !cctx->idle, arg, "context is in pool");
+	if (!cctx->ctx) checkmem(L, cctx->ctx = ZSTD_createCCtx());
+	return cctx;
+}
+
+/* Records level that took effect */
+static void uselevel(CCtx *cctx, int level) {
+	cctx->adapt.level = level;
+	cctx->adapt.next = 0;
+	cctx->adapt.hist[cctx->adapt.nhist++ % ADAPT_HIST] = level;
+}
+
+/* Ends frame in progress (if any) and restores compression level lowered for stored frame */
+void zstd__endframe(lua_State *L, CCtx *cctx) {
+	cctx->frame = 0;
+	if (!cctx->probe.lowered) return;
+	cctx->probe.lowered = 0;
+	zstd__check(L, ZSTD_CCtx_reset(cctx->ctx, ZSTD_reset_session_only)); /* Parameters can't be changed mid-frame */
+	zstd__check(L, ZSTD_CCtx_setParameter(cctx->ctx, ZSTD_c_compressionLevel, cctx->probe.level));
+}
+
+void zstd__resetcctx(lua_State *L, int arg, int mode) {
+	CCtx *cctx = checkcctx(L, arg);
+	zstd__check(L, ZSTD_CCtx_reset(cctx->ctx, mode));
+	if (mode != ZSTD_reset_session_only) cctx->probe.lowered = 0; // Lowered level goes away with parameters
+	zstd__endframe(L, cctx);
+	if (cctx->adapt.next) uselevel(cctx, cctx->adapt.next); // Held level applies to the next frame
+	if (mode == ZSTD_reset_session_only) return; // Dictionary stays referenced
+	cctx->adapt.on = 0; // Compression level is back to default
+	cctx->probe.on = 0;
+	cctx->probe.mode = 0;
+	cctx->nonblock = 0;
+	lua_getuservalue(L, arg);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 1);
+}
+
 static const char *const s_param[] = {
 	"compressionLevel",
 	"windowLog",
@@ -98,52 +147,176 @@ int zstd__checkcctxparam(lua_State *L, int arg) {
 /* ARG: name
 ** RES: value */
 static int m_getParameter(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	int param = zstd__checkcctxparam(L, 2);
 	int value;
-	zstd__check(L, ZSTD_CCtx_getParameter(cctx, param, &value));
+	zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, param, &value));
 	lua_pushinteger(L, value);
 	return 1;
 }
 
 /* ARG: name, value */
 static int m_setParameter(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	int param = zstd__checkcctxparam(L, 2);
 	int value = luaL_checkinteger(L, 3);
-	zstd__check(L, ZSTD_CCtx_setParameter(cctx, param, value));
+	zstd__check(L, ZSTD_CCtx_setParameter(cctx->ctx, param, value));
 	return 0;
 }
 
 /* ARG: cctxparams */
 static int m_setParameters(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	ZSTD_CCtx_params *params = checkcctxparams(L, 2);
-	zstd__check(L, ZSTD_CCtx_setParametersUsingCCtxParams(cctx, params));
+	zstd__check(L, ZSTD_CCtx_setParametersUsingCCtxParams(cctx->ctx, params));
 	return 0;
 }
 
 /* ARG: size */
 static int m_setPledgedSrcSize(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	lua_Integer size = luaL_checkinteger(L, 2);
 	checkrange(L, size >= -1, 2);
-	zstd__check(L, ZSTD_CCtx_setPledgedSrcSize(cctx, size));
+	zstd__check(L, ZSTD_CCtx_setPledgedSrcSize(cctx->ctx, size));
 	return 0;
 }
 
 /* ARG: cdict */
 static int m_refCDict(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	ZSTD_CDict *cdict = checkcdict(L, 2);
 	lua_settop(L, 2);
 	lua_getuservalue(L, 1);
 	lua_insert(L, 2);
 	lua_rawseti(L, 2, 1);
-	zstd__check(L, ZSTD_CCtx_refCDict(cctx, cdict));
+	zstd__check(L, ZSTD_CCtx_refCDict(cctx->ctx, cdict));
+	return 0;
+}
+
+static void setlevel(lua_State *L, CCtx *cctx, int level) {
+	zstd__check(L, ZSTD_CCtx_setParameter(cctx->ctx, ZSTD_c_compressionLevel, level));
+	uselevel(cctx, level);
+}
+
+static void restart(CCtx *cctx, double now) {
+	cctx->adapt.start = now;
+	cctx->adapt.busy = 0;
+	cctx->adapt.in = 0;
+}
+
+/* Steps compression level down when compression can't keep up with input (or input piles up in workers)
+** and up when the context is mostly idle. Level changes take effect with the next job or frame. In
+** single-threaded mode, a decision made in the middle of a frame is held (and no more decisions are made)
+** until the frame ends, since measurements within the frame can't reflect it. */
+static void adapt(lua_State *L, CCtx *cctx, size_t len, double t0, int op) {
+	int level = cctx->adapt.level, dir = 0, mt;
+	double now = zstd__clock(), load;
+	ZSTD_frameProgression fp;
+	cctx->adapt.busy += now - t0;
+	cctx->adapt.in += len;
+	if (cctx->adapt.next) {
+		if (op != ZSTD_e_end) return;
+		uselevel(cctx, cctx->adapt.next);
+		restart(cctx, now);
+		return;
+	}
+	if (cctx->adapt.in < ADAPT_WINDOW && (op != ZSTD_e_end || !cctx->adapt.in)) return;
+	fp = ZSTD_getFrameProgression(cctx->ctx);
+	load = cctx->adapt.busy / (now - cctx->adapt.start); /* Compression speed vs input rate */
+	if (load > 0.8 || fp.ingested - fp.consumed > ADAPT_WINDOW) dir = -1;
+	else if (load < 0.4) dir = 1;
+	if (dir && (level += dir) == 0) level += dir; /* Level 0 means default */
+	if (dir && level >= cctx->adapt.min && level <= cctx->adapt.max) {
+		zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, ZSTD_c_nbWorkers, &mt));
+		zstd__check(L, ZSTD_CCtx_setParameter(cctx->ctx, ZSTD_c_compressionLevel, level));
+		if (mt || op == ZSTD_e_end) uselevel(cctx, level);
+		else cctx->adapt.next = level;
+	}
+	restart(cctx, now);
+}
+
+/* ARG: [min, max] */
+static int m_setAdaptive(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	int min, max, level;
+	if (lua_isnoneornil(L, 2)) {
+		cctx->adapt.on = 0;
+		return 0;
+	}
+	min = luaL_checkinteger(L, 2);
+	max = luaL_checkinteger(L, 3);
+	checkrange(L, min >= ZSTD_minCLevel() && min <= ZSTD_maxCLevel(), 2);
+	checkrange(L, max >= min && max <= ZSTD_maxCLevel(), 3);
+	zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, ZSTD_c_compressionLevel, &level));
+	if (!level) level = ZSTD_CLEVEL_DEFAULT;
+	if (level < min) level = min;
+	if (level > max) level = max;
+	cctx->adapt.on = 1;
+	cctx->adapt.min = min;
+	cctx->adapt.max = max;
+	cctx->adapt.nhist = 0;
+	restart(cctx, zstd__clock());
+	setlevel(L, cctx, level);
 	return 0;
 }
 
+/* RES: level, history | nil */
+static int m_getAdaptive(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	unsigned i, n = cctx->adapt.nhist, k = n > ADAPT_HIST ? n - ADAPT_HIST : 0;
+	if (!cctx->adapt.on) return 0;
+	lua_pushinteger(L, cctx->adapt.level);
+	lua_createtable(L, n - k, 0);
+	for (i = k; i < n; ++i) {
+		lua_pushinteger(L, cctx->adapt.hist[i % ADAPT_HIST]);
+		lua_rawseti(L, -2, i - k + 1);
+	}
+	return 2;
+}
+
+/* Runs at the start of each frame */
+static void probe(lua_State *L, CCtx *cctx, const void *src, size_t len) {
+	cctx->probe.mode = 0;
+	if (!cctx->probe.on) return;
+	if (!zstd__probe(L, src, len)) {
+		cctx->probe.mode = 1;
+		return;
+	}
+	zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, ZSTD_c_compressionLevel, &cctx->probe.level));
+	zstd__check(L, ZSTD_CCtx_setParameter(cctx->ctx, ZSTD_c_compressionLevel, ZSTD_minCLevel())); /* Skip match finding, emit raw blocks */
+	cctx->probe.mode = 2;
+	cctx->probe.lowered = 1;
+}
+
+/* ARG: flag */
+static int m_setProbe(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	cctx->probe.on = lua_toboolean(L, 2);
+	return 0;
+}
+
+/* RES: mode | nil */
+static int m_getProbe(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	if (!cctx->probe.mode) return 0;
+	lua_pushstring(L, cctx->probe.mode == 2 ? "stored" : "compressed");
+	return 1;
+}
+
+/* ARG: flag */
+static int m_setNonBlocking(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	cctx->nonblock = lua_toboolean(L, 2);
+	return 0;
+}
+
+/* RES: flag */
+static int m_getNonBlocking(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	lua_pushboolean(L, cctx->nonblock);
+	return 1;
+}
+
 static const char *const s_op[] = {
 	"continue",
 	"flush",
@@ -152,24 +325,38 @@ static const char *const s_op[] = {
 };
 
 /* ARG: data, [op]
-** RES: data | nil, error */
+** RES: data, [remaining] | nil, error */
 static int m_compressStream(lua_State *L) {
-	size_t res, slen, spos = 0, dlen = 0, dpos = 0, blen = 100;
+	size_t res = 0, slen, spos = 0, dlen = 0, dpos = 0, blen = 100;
 	void *ud, *buf, *dst = 0;
-	int err = 0;
+	int err = 0, n = 0, mt = 0;
 	lua_Alloc allocf = lua_getallocf(L, &ud);
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	const void *src = luaL_checklstring(L, 2, &slen);
 	int op = luaL_checkoption(L, 3, s_op[0], s_op);
-	for (;;) {
-		if (!(buf = allocf(ud, dst, dlen, blen))) {
-			err = ZSTD_error_memory_allocation;
-			break;
+	double t0 = cctx->adapt.on || cctx->total ? zstd__clock() : 0;
+	double c0 = cctx->total ? zstd__cpuclock() : 0;
+	if (cctx->nonblock) zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, ZSTD_c_nbWorkers, &mt));
+	if (!cctx->frame && slen) probe(L, cctx, src, slen);
+	if (mt && !slen && !ZSTD_toFlushNow(cctx->ctx) && ZSTD_getFrameProgression(cctx->ctx).nbActiveWorkers) res = 1; /* Library would wait for workers */
+	else for (;;) {
+		size_t lim = mt ? dpos + ZSTD_toFlushNow(cctx->ctx) : blen; /* Full output buffer makes workers return without waiting */
+		if (blen < lim) blen = lim;
+		if (dlen < blen) {
+			if (dlen) ++n;
+			if (!(buf = allocf(ud, dst, dlen, blen))) {
+				err = ZSTD_error_memory_allocation;
+				break;
+			}
+			dst = buf;
+			dlen = blen;
 		}
-		dst = buf;
-		dlen = blen;
-		if (!(res = ZSTD_compressStream2_simpleArgs(cctx, dst, dlen, &dpos, src, slen, &spos, op))) break; /* No more data to flush */
+		if (!(res = ZSTD_compressStream2_simpleArgs(cctx->ctx, dst, lim, &dpos, src, slen, &spos, op))) break; /* No more data to flush */
 		if ((err = ZSTD_getErrorCode(res))) break; /* Error occurred */
+		if (mt) {
+			if (spos == slen && !ZSTD_toFlushNow(cctx->ctx)) break; /* Workers are still busy */
+			continue;
+		}
 		blen <<= 1;
 		res += dlen; /* Last result provides a hint on how much data is left */
 		if (blen < res) blen = res;
@@ -178,7 +365,110 @@ static int m_compressStream(lua_State *L) {
 		allocf(ud, dst, dlen, 0);
 		return 2;
 	}
-	lua_pushlstring(L, dst, dpos);
+	lua_pushlstring(L, dpos ? dst : "", dpos);
+	allocf(ud, dst, dlen, 0);
+	if (op == ZSTD_e_end && res) op = ZSTD_e_flush; /* Frame epilogue is still pending */
+	cctx->frame = op != ZSTD_e_end && (cctx->frame || slen);
+	if (cctx->total) zstd__updatestats(&cctx->stats, cctx->total, slen, dpos, op == ZSTD_e_end, n, t0, c0);
+	if (cctx->adapt.on && cctx->probe.mode != 2) adapt(L, cctx, slen, t0, op);
+	if (op == ZSTD_e_end) zstd__endframe(L, cctx);
+	if (!cctx->nonblock) return 1;
+	lua_pushinteger(L, res);
+	return 2;
+}
+
+/* ARG: data
+** RES: data | nil, error */
+static int m_compress(lua_State *L) {
+	size_t res, slen, dlen;
+	void *ud, *dst;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	CCtx *cctx = checkcctx(L, 1);
+	const void *src = luaL_checklstring(L, 2, &slen);
+	double t0 = cctx->total ? zstd__clock() : 0;
+	double c0 = cctx->total ? zstd__cpuclock() : 0;
+	zstd__endframe(L, cctx);
+	checkmem(L, dst = allocf(ud, 0, 0, dlen = ZSTD_compressBound(slen)));
+	if (zstd__error(L, res = ZSTD_compress2(cctx->ctx, dst, dlen, src, slen))) { /* Input and output stay stable for the whole frame */
+		allocf(ud, dst, dlen, 0);
+		return 2;
+	}
+	lua_pushlstring(L, dst, res);
+	allocf(ud, dst, dlen, 0);
+	if (cctx->total) zstd__updatestats(&cctx->stats, cctx->total, slen, res, 1, 0, t0, c0);
+	return 1;
+}
+
+/* Copies parameters and dictionary of 'cctx' to private context 'ctx' */
+static size_t copyparams(lua_State *L, CCtx *cctx, ZSTD_CCtx *ctx) {
+	size_t i, res;
+	int value;
+	for (i = 0; i < sizeof(v_param) / sizeof(*v_param); ++i) {
+		if (ZSTD_isError(res = ZSTD_CCtx_getParameter(cctx->ctx, v_param[i], &value))) return res;
+		if (v_param[i] == ZSTD_c_compressionLevel && cctx->probe.lowered) value = cctx->probe.level; /* Stored frame in progress */
+		if (ZSTD_isError(res = ZSTD_CCtx_setParameter(ctx, v_param[i], value))) return res;
+	}
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 1);
+	res = lua_isnil(L, -1) ? 0 : ZSTD_CCtx_refCDict(ctx, *(ZSTD_CDict **)lua_touserdata(L, -1)); /* Only CDict is kept */
+	lua_pop(L, 2);
+	return res;
+}
+
+/* ARG: data
+** RES: sequences | nil, error */
+static int m_generateSequences(lua_State *L) {
+	size_t res, slen, dlen;
+	void *ud;
+	ZSTD_Sequence *dst;
+	ZSTD_CCtx *ctx;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	CCtx *cctx = checkcctx(L, 1);
+	const void *src = luaL_checklstring(L, 2, &slen);
+	lua_settop(L, 2);
+	dlen = SEQUENCEBOUND(slen);
+	checkmem(L, ctx = ZSTD_createCCtx()); /* Library keeps pointer to output in context, so it can't be reused */
+	if (!(dst = allocf(ud, 0, 0, dlen * sizeof(*dst)))) {
+		ZSTD_freeCCtx(ctx);
+		checkmem(L, 0);
+	}
+	if (ZSTD_isError(res = copyparams(L, cctx, ctx)) || ZSTD_isError(res = ZSTD_generateSequences(ctx, dst, dlen, src, slen))) {
+		ZSTD_freeCCtx(ctx);
+		allocf(ud, dst, dlen * sizeof(*dst), 0);
+		zstd__error(L, res);
+		return 2;
+	}
+	ZSTD_freeCCtx(ctx);
+	zstd__newSequences(L, dst, res);
+	allocf(ud, dst, dlen * sizeof(*dst), 0);
+	return 1;
+}
+
+/* ARG: sequences
+** RES: data | nil, error */
+static int m_compressSequences(lua_State *L) {
+	size_t res, slen, dlen;
+	void *ud, *dst;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	CCtx *cctx = checkcctx(L, 1);
+	Sequences *seqs = checksequences(L, 2);
+	const void *src;
+	int delim;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 2);
+	lua_rawgeti(L, 3, 1); /* Data sequences were generated from */
+	src = lua_tolstring(L, 4, &slen);
+	zstd__check(L, ZSTD_CCtx_getParameter(cctx->ctx, ZSTD_c_blockDelimiters, &delim));
+	luaL_argcheck(L, delim == seqs->delim, 2, "block delimiters mismatch");
+	zstd__endframe(L, cctx);
+	checkmem(L, dst = allocf(ud, 0, 0, dlen = ZSTD_compressBound(slen)));
+	res = ZSTD_compressSequences(cctx->ctx, dst, dlen, seqs->seq, seqs->n, src, slen);
+	ZSTD_CCtx_reset(cctx->ctx, ZSTD_reset_session_only); /* Context may be left mid-stream */
+	if (zstd__error(L, res)) {
+		allocf(ud, dst, dlen, 0);
+		return 2;
+	}
+	lua_pushlstring(L, dst, res);
 	allocf(ud, dst, dlen, 0);
 	return 1;
 }
@@ -189,37 +479,55 @@ static int m_compressBlock(lua_State *L) {
 	size_t res, slen, dlen;
 	void *ud, *dst;
 	lua_Alloc allocf = lua_getallocf(L, &ud);
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = checkcctx(L, 1);
 	const void *src = luaL_checklstring(L, 2, &slen);
 	ZSTD_CDict *cdict = checkcdict(L, 3);
-	zstd__check(L, ZSTD_compressBegin_usingCDict(cctx, cdict));
-	checkmem(L, dst = allocf(ud, 0, 0, dlen = ZSTD_getBlockSize(cctx)));
-	if (zstd__error(L, res = ZSTD_compressBlock(cctx, dst, dlen, src, slen))) {
+	double t0 = cctx->total ? zstd__clock() : 0;
+	double c0 = cctx->total ? zstd__cpuclock() : 0;
+	zstd__endframe(L, cctx);
+	zstd__check(L, ZSTD_compressBegin_usingCDict(cctx->ctx, cdict));
+	checkmem(L, dst = allocf(ud, 0, 0, dlen = ZSTD_getBlockSize(cctx->ctx)));
+	if (zstd__error(L, res = ZSTD_compressBlock(cctx->ctx, dst, dlen, src, slen))) {
 		allocf(ud, dst, dlen, 0);
 		return 2;
 	}
 	lua_pushlstring(L, dst, res);
 	allocf(ud, dst, dlen, 0);
+	if (cctx->total) zstd__updatestats(&cctx->stats, cctx->total, slen, res, 0, 0, t0, c0);
 	return 1;
 }
 
+/* ARG: flag */
+static int m_setStats(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	cctx->total = lua_toboolean(L, 2) ? zstd__gettotal(L) : 0;
+	return 0;
+}
+
+/* RES: stats */
+static int m_stats(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	zstd__pushstats(L, &cctx->stats);
+	return 1;
+}
+
+static int m_resetStats(lua_State *L) {
+	CCtx *cctx = checkcctx(L, 1);
+	memset(&cctx->stats, 0, sizeof(cctx->stats));
+	return 0;
+}
+
 /* ARG: [mode] */
 static int m_reset(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
-	int mode = zstd__checkresetmode(L, 2);
-	zstd__check(L, ZSTD_CCtx_reset(cctx, mode));
-	if (mode == ZSTD_reset_session_only) return 0; // Dictionary stays referenced
-	lua_getuservalue(L, 1);
-	lua_pushnil(L);
-	lua_rawseti(L, -2, 1);
+	zstd__resetcctx(L, 1, zstd__checkresetmode(L, 2));
 	return 0;
 }
 
 static int m__gc(lua_State *L) {
-	ZSTD_CCtx *cctx = checkcctx(L, 1);
+	CCtx *cctx = luaL_checkudata(L, 1, TYPE_CCTX);
 	lua_pushnil(L);
 	lua_setmetatable(L, 1);
-	ZSTD_freeCCtx(cctx);
+	ZSTD_freeCCtx(cctx->ctx);
 	return 0;
 }
 
@@ -229,19 +537,32 @@ static const luaL_Reg t_cctx[] = {
 	{"setParameters", m_setParameters},
 	{"setPledgedSrcSize", m_setPledgedSrcSize},
 	{"refCDict", m_refCDict},
+	{"setAdaptive", m_setAdaptive},
+	{"getAdaptive", m_getAdaptive},
+	{"setProbe", m_setProbe},
+	{"getProbe", m_getProbe},
+	{"compress", m_compress},
+	{"setNonBlocking", m_setNonBlocking},
+	{"getNonBlocking", m_getNonBlocking},
 	{"compressStream", m_compressStream},
 	{"compressBlock", m_compressBlock},
+	{"generateSequences", m_generateSequences},
+	{"compressSequences", m_compressSequences},
 	{"reset", m_reset},
+	{"setStats", m_setStats},
+	{"stats", m_stats},
+	{"resetStats", m_resetStats},
 	{"__gc", m__gc},
 	{0, 0}
 };
 
 /* RES: cctx */
 int zstd__newCCtx(lua_State *L) {
-	ZSTD_CCtx **cctx = lua_newuserdata(L, sizeof(*cctx));
-	checkmem(L, *cctx = ZSTD_createCCtx());
+	CCtx *cctx = lua_newuserdata(L, sizeof(*cctx));
+	memset(cctx, 0, sizeof(*cctx));
+	checkmem(L, cctx->ctx = ZSTD_createCCtx());
 	lua_createtable(L, 1, 0);
-	lua_setuservalue(L, 1);
+	lua_setuservalue(L, -2);
 	if (luaL_newmetatable(L, TYPE_CCTX)) {
 		lua_pushboolean(L, 0);
 		lua_setfield(L, -2, "__metatable");
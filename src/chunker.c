@@ -0,0 +1,278 @@
+/*
+** Copyright (C) 2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+#define DIGEST_SIZE 32
+
+typedef struct {
+	size_t min, max; /* Chunk size limits */
+	unsigned long long mask; /* Boundary mask */
+	size_t len, cap, pos; /* Pending input length, capacity and scanned length */
+	unsigned long long hash; /* Rolling hash of the current chunk */
+	char *buf;
+	int dedup;
+	unsigned long long gear[256];
+} Chunker;
+
+#define checkchunker(L, arg) ((Chunker *)luaL_checkudata(L, arg, TYPE_CHUNKER))
+
+/* Fixed pseudo-random gear table (splitmix64), so that boundaries are identical everywhere */
+static void initgear(unsigned long long *gear) {
+	unsigned long long x = 0, z;
+	int i;
+	for (i = 0; i < 256; ++i) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static const uint32_t k256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256block(uint32_t *h, const unsigned char *p) {
+	uint32_t w[64], v[8], t1, t2;
+	int i;
+	for (i = 0; i < 16; ++i) w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (; i < 64; ++i) {
+		t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+	memcpy(v, h, sizeof(v));
+	for (i = 0; i < 64; ++i) {
+		t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k256[i] + w[i];
+		t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(*v));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; ++i) h[i] += v[i];
+}
+
+/* SHA-256 digest, so that content can be trusted by digest */
+static void digest(const unsigned char *buf, size_t len, char *res) {
+	uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	unsigned long long bits = (unsigned long long)len << 3;
+	unsigned char tail[128] = {0};
+	size_t i, n = (len & 63) < 56 ? 64 : 128;
+	for (i = 0; i + 64 <= len; i += 64) sha256block(h, buf + i);
+	if (len > i) memcpy(tail, buf + i, len - i);
+	tail[len - i] = 0x80;
+	for (i = 0; i < 8; ++i) tail[n - 1 - i] = (bits >> (i * 8)) & 0xff;
+	for (i = 0; i < n; i += 64) sha256block(h, tail + i);
+	for (i = 0; i < DIGEST_SIZE; ++i) res[i] = (h[i >> 2] >> (24 - (i & 3) * 8)) & 0xff;
+}
+
+/* Returns non-zero if chunk 'id' of size 'len' is in the table at 'idx' */
+static int known(lua_State *L, int idx, const char *id, size_t len) {
+	int res;
+	lua_pushlstring(L, id, DIGEST_SIZE);
+	lua_rawget(L, idx);
+	res = lua_tointeger(L, -1) == (lua_Integer)len; /* Size mismatch means a different chunk */
+	lua_pop(L, 1);
+	return res;
+}
+
+/* Appends entry for chunk 'buf' to the table at 'res'. New chunks are recorded in the table at 'res' + 1. */
+static void emit(lua_State *L, Chunker *chunker, int res, const char *buf, size_t len) {
+	size_t size, dlen;
+	void *ud, *dst;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	CCtx *cctx;
+	char id[DIGEST_SIZE];
+	digest((const unsigned char *)buf, len, id);
+	lua_createtable(L, 0, 3);
+	lua_pushlstring(L, id, sizeof(id));
+	lua_setfield(L, -2, "digest");
+	lua_pushinteger(L, len);
+	lua_setfield(L, -2, "size");
+	if (!chunker->dedup || !(known(L, res + 1, id, len) || known(L, res + 2, id, len))) {
+		lua_getuservalue(L, 1);
+		lua_rawgeti(L, -1, 1);
+		cctx = checkcctx(L, -1);
+		zstd__endframe(L, cctx);
+		checkmem(L, dst = allocf(ud, 0, 0, dlen = ZSTD_compressBound(len)));
+		if (ZSTD_isError(size = ZSTD_compress2(cctx->ctx, dst, dlen, buf, len))) {
+			allocf(ud, dst, dlen, 0);
+			zstd__check(L, size);
+		}
+		lua_pushlstring(L, dst, size);
+		allocf(ud, dst, dlen, 0);
+		lua_setfield(L, -4, "frame");
+		lua_pop(L, 2);
+		lua_pushlstring(L, id, sizeof(id));
+		lua_pushinteger(L, len);
+		lua_rawset(L, res + 2);
+	}
+	lua_rawseti(L, res, lua_rawlen(L, res) + 1);
+}
+
+/* Cuts pending input into chunks at content-defined boundaries and pushes a table of entries. The index
+** and pending input are updated only after all chunks are built, so that an error leaves the writer intact. */
+static void process(lua_State *L, Chunker *chunker, int last) {
+	size_t i, start = 0;
+	unsigned long long hash = chunker->hash;
+	int res = lua_gettop(L) + 1;
+	lua_newtable(L);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 2);
+	lua_replace(L, -2); /* Index */
+	lua_newtable(L); /* New chunks */
+	for (i = chunker->pos; i < chunker->len; ++i) {
+		if (i + 1 - start < chunker->min) continue; /* Skip hashing below minimum size */
+		hash = (hash << 1) + chunker->gear[(unsigned char)chunker->buf[i]];
+		if ((hash & chunker->mask) && i + 1 - start < chunker->max) continue;
+		emit(L, chunker, res, chunker->buf + start, i + 1 - start); /* Boundary found */
+		start = i + 1;
+		hash = 0;
+	}
+	if (last && start < chunker->len) {
+		emit(L, chunker, res, chunker->buf + start, chunker->len - start);
+		start = chunker->len;
+	}
+	for (lua_pushnil(L); lua_next(L, res + 2); ) { /* Commit new chunks to index */
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, res + 1);
+	}
+	lua_pop(L, 2);
+	if (start) memmove(chunker->buf, chunker->buf + start, chunker->len -= start);
+	chunker->pos = chunker->len;
+	chunker->hash = last ? 0 : hash;
+}
+
+/* ARG: data
+** RES: entries */
+static int m_write(lua_State *L) {
+	size_t len, cap;
+	void *ud, *buf;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	Chunker *chunker = checkchunker(L, 1);
+	const char *src = luaL_checklstring(L, 2, &len);
+	if ((cap = chunker->len + len) > chunker->cap) {
+		if (cap < chunker->cap << 1) cap = chunker->cap << 1;
+		checkmem(L, buf = allocf(ud, chunker->buf, chunker->cap, cap));
+		chunker->buf = buf;
+		chunker->cap = cap;
+	}
+	if (len) memcpy(chunker->buf + chunker->len, src, len);
+	chunker->len += len;
+	process(L, chunker, 0);
+	return 1;
+}
+
+/* RES: entries */
+static int m_finish(lua_State *L) {
+	process(L, checkchunker(L, 1), 1);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	void *ud;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	Chunker *chunker = checkchunker(L, 1);
+	lua_pushnil(L);
+	lua_setmetatable(L, 1);
+	allocf(ud, chunker->buf, chunker->cap, 0);
+	return 0;
+}
+
+static const luaL_Reg t_chunker[] = {
+	{"write", m_write},
+	{"finish", m_finish},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+static size_t optsize(lua_State *L, const char *name, size_t def) {
+	lua_Integer val = def;
+	lua_getfield(L, 2, name);
+	if (!lua_isnil(L, -1) && (lua_type(L, -1) != LUA_TNUMBER || (val = lua_tointeger(L, -1)) <= 0)) luaL_error(L, "invalid option '%s'", name);
+	lua_pop(L, 1);
+	return val;
+}
+
+/* ARG: cctx, [options]
+** RES: chunker */
+int zstd__newChunker(lua_State *L) {
+	size_t min, avg, max;
+	int bits, dedup;
+	Chunker *chunker;
+	checkcctx(L, 1);
+	if (lua_isnoneornil(L, 2)) lua_newtable(L);
+	else luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	min = optsize(L, "minSize", 1 << 16);
+	avg = optsize(L, "avgSize", 1 << 18);
+	max = optsize(L, "maxSize", 1 << 20);
+	if (avg & (avg - 1)) luaL_error(L, "invalid option 'avgSize'");
+	if (max < min) luaL_error(L, "invalid option 'maxSize'");
+	for (bits = 0; (size_t)1 << bits < avg; ++bits);
+	lua_getfield(L, 2, "dedup");
+	dedup = lua_isnil(L, -1) || lua_toboolean(L, -1);
+	lua_getfield(L, 2, "index");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+	} else if (!lua_istable(L, -1)) luaL_error(L, "invalid option 'index'");
+	chunker = lua_newuserdata(L, sizeof(*chunker));
+	memset(chunker, 0, sizeof(*chunker));
+	chunker->min = min;
+	chunker->mask = bits ? (avg - 1ULL) << (64 - bits) : 0; /* Use upper bits of rolling hash */
+	chunker->max = max;
+	chunker->dedup = dedup;
+	initgear(chunker->gear);
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 4);
+	lua_rawseti(L, -2, 2);
+	lua_setuservalue(L, -2);
+	if (luaL_newmetatable(L, TYPE_CHUNKER)) {
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "__metatable");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+		luaL_register(L, 0, t_chunker);
+#else
+		luaL_setfuncs(L, t_chunker, 0);
+#endif
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
@@ -35,22 +35,68 @@
 #define TYPE_CCTXPARAMS "zstd.CCtxParams"
 #define TYPE_CDICT "zstd.CDict"
 
+#define TYPE_STATS "zstd.Stats"
+
+#define TYPE_POOL "zstd.Pool"
+#define TYPE_CHUNKER "zstd.Chunker"
+#define TYPE_SEQUENCES "zstd.Sequences"
+
 #define TYPE_DCTX "zstd.DCtx"
 #define TYPE_DDICT "zstd.DDict"
 
-#define checkcctx(L, arg) (*(ZSTD_CCtx **)luaL_checkudata(L, arg, TYPE_CCTX))
+#define checkcctx(L, arg) zstd__checkcctx(L, arg)
 #define checkcctxparams(L, arg) (*(ZSTD_CCtx_params **)luaL_checkudata(L, arg, TYPE_CCTXPARAMS))
 #define checkcdict(L, arg) (*(ZSTD_CDict **)luaL_checkudata(L, arg, TYPE_CDICT))
+#define checksequences(L, arg) ((Sequences *)luaL_checkudata(L, arg, TYPE_SEQUENCES))
 
-#define checkdctx(L, arg) (*(ZSTD_DCtx **)luaL_checkudata(L, arg, TYPE_DCTX))
+#define checkdctx(L, arg) zstd__checkdctx(L, arg)
 #define checkddict(L, arg) (*(ZSTD_DDict **)luaL_checkudata(L, arg, TYPE_DDICT))
 
 #define checkmem(L, cond) ((void)((cond) || luaL_error(L, "not enough memory")))
 #define checkrange(L, cond, arg) luaL_argcheck(L, cond, arg, "value out of range")
 
+#define ADAPT_HIST 16 /* Number of adaptive level decisions kept for monitoring */
+
+typedef struct {
+	unsigned long long in, out, calls, frames, growths;
+	double wall, cpu; /* Time spent in calls */
+} Stats;
+
+typedef struct {
+	ZSTD_CCtx *ctx;
+	Stats stats, *total; /* Context and module-wide statistics (if enabled) */
+	struct { /* Adaptive compression level controller */
+		int on, min, max, level, next; /* Level in effect, level held until the end of frame (if any) */
+		double start, busy; /* Window start time, time spent compressing in window */
+		size_t in; /* Amount of input consumed in window */
+		int hist[ADAPT_HIST];
+		unsigned nhist;
+	} adapt;
+	struct { /* Incompressible data detection */
+		int on, mode, level; /* Decision for current frame (1 - compressed, 2 - stored), level to restore */
+		int lowered; /* Level is lowered for stored frame in progress */
+	} probe;
+	int frame; /* Frame in progress */
+	int nonblock; /* Return without waiting for worker threads */
+	int idle; /* Held by pool */
+} CCtx;
+
+typedef struct {
+	ZSTD_DCtx *ctx;
+	Stats stats, *total; /* Context and module-wide statistics (if enabled) */
+	int idle; /* Held by pool */
+} DCtx;
+
+typedef struct {
+	size_t n;
+	int delim; /* Block delimiters are present */
+	ZSTD_Sequence seq[];
+} Sequences;
+
 #if LUA_VERSION_NUM < 502
 #define lua_getuservalue(L, idx) lua_getfenv(L, idx)
 #define lua_setuservalue(L, idx) lua_setfenv(L, idx)
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
 #endif
 
 #ifdef _WIN32
@@ -72,9 +118,31 @@ int zstd__newCDict(lua_State *L);
 int zstd__newDCtx(lua_State *L);
 int zstd__newDDict(lua_State *L);
 
+int zstd__newPool(lua_State *L);
+int zstd__newChunker(lua_State *L);
+
+int zstd__tune(lua_State *L);
+
+Sequences *zstd__newSequences(lua_State *L, const ZSTD_Sequence *seq, size_t n);
+
+CCtx *zstd__checkcctx(lua_State *L, int arg);
+void zstd__endframe(lua_State *L, CCtx *cctx);
+void zstd__resetcctx(lua_State *L, int arg, int mode);
+
+DCtx *zstd__checkdctx(lua_State *L, int arg);
+void zstd__resetdctx(lua_State *L, int arg, int mode);
+
 int zstd__pusherror(lua_State *L, int err);
 int zstd__error(lua_State *L, size_t res);
 void zstd__check(lua_State *L, size_t res);
+double zstd__clock(void);
+double zstd__cpuclock(void);
+
+Stats *zstd__gettotal(lua_State *L);
+void zstd__pushstats(lua_State *L, const Stats *stats);
+int zstd__probe(lua_State *L, const void *buf, size_t len);
+
+void zstd__updatestats(Stats *stats, Stats *total, size_t in, size_t out, int frames, int growths, double wall, double cpu);
 
 int zstd__checkresetmode(lua_State *L, int arg);
 int zstd__checkcctxparam(lua_State *L, int arg);
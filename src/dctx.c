@@ -20,8 +20,29 @@
 ** THE SOFTWARE.
 */
 
+#include <string.h>
 #include "common.h"
 
+#define MAXRATIO 1024 /* Largest ratio of declared content size to input size trusted for allocation */
+
+/* Context workspace can be freed by pool and is recreated lazily */
+DCtx *zstd__checkdctx(lua_State *L, int arg) {
+	DCtx *dctx = luaL_checkudata(L, arg, TYPE_DCTX);
+	luaL_argcheck(L, !dctx->idle, arg, "context is in pool");
+	if (!dctx->ctx) checkmem(L, dctx->ctx = ZSTD_createDCtx());
+	return dctx;
+}
+
+void zstd__resetdctx(lua_State *L, int arg, int mode) {
+	DCtx *dctx = checkdctx(L, arg);
+	zstd__check(L, ZSTD_DCtx_reset(dctx->ctx, mode));
+	if (mode == ZSTD_reset_session_only) return; // Dictionary stays referenced
+	lua_getuservalue(L, arg);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 1);
+}
+
 static const char *const s_param[] = {
 	"windowLogMax",
 	"format",
@@ -45,53 +66,55 @@ int zstd__checkdctxparam(lua_State *L, int arg) {
 /* ARG: name
 ** RES: value */
 static int m_getParameter(lua_State *L) {
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = checkdctx(L, 1);
 	int param = zstd__checkdctxparam(L, 2);
 	int value;
-	zstd__check(L, ZSTD_DCtx_getParameter(dctx, param, &value));
+	zstd__check(L, ZSTD_DCtx_getParameter(dctx->ctx, param, &value));
 	lua_pushinteger(L, value);
 	return 1;
 }
 
 /* ARG: name, value */
 static int m_setParameter(lua_State *L) {
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = checkdctx(L, 1);
 	int param = zstd__checkdctxparam(L, 2);
 	int value = luaL_checkinteger(L, 3);
-	zstd__check(L, ZSTD_DCtx_setParameter(dctx, param, value));
+	zstd__check(L, ZSTD_DCtx_setParameter(dctx->ctx, param, value));
 	return 0;
 }
 
 /* ARG: ddict */
 static int m_refDDict(lua_State *L) {
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = checkdctx(L, 1);
 	ZSTD_DDict *ddict = checkddict(L, 2);
 	lua_settop(L, 2);
 	lua_getuservalue(L, 1);
 	lua_insert(L, 2);
 	lua_rawseti(L, 2, 1);
-	zstd__check(L, ZSTD_DCtx_refDDict(dctx, ddict));
+	zstd__check(L, ZSTD_DCtx_refDDict(dctx->ctx, ddict));
 	return 0;
 }
 
 /* ARG: data
 ** RES: data, ['end'] | nil, error */
 static int m_decompressStream(lua_State *L) {
-	size_t res, slen, spos = 0, dlen = 0, dpos = 0, blen = 100;
+	size_t res = 0, slen, spos = 0, dlen = 0, dpos = 0, blen = 100;
 	void *ud, *buf, *dst = 0;
-	int err = 0;
+	int err = 0, n = 0;
 	lua_Alloc allocf = lua_getallocf(L, &ud);
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = checkdctx(L, 1);
 	const void *src = luaL_checklstring(L, 2, &slen);
+	double t0 = dctx->total ? zstd__clock() : 0;
+	double c0 = dctx->total ? zstd__cpuclock() : 0;
 	luaL_argcheck(L, slen, 2, "empty data"); /* Ensure forward progress */
-	for (;;) {
+	for (;; ++n) {
 		if (!(buf = allocf(ud, dst, dlen, blen))) {
 			err = ZSTD_error_memory_allocation;
 			break;
 		}
 		dst = buf;
 		dlen = blen;
-		if (!(res = ZSTD_decompressStream_simpleArgs(dctx, dst, dlen, &dpos, src, slen, &spos))) break; /* End of stream */
+		if (!(res = ZSTD_decompressStream_simpleArgs(dctx->ctx, dst, dlen, &dpos, src, slen, &spos))) break; /* End of stream */
 		if ((err = ZSTD_getErrorCode(res))) break; /* Error occurred */
 		if (dpos < dlen) break; /* No more data to flush */
 		blen <<= 1;
@@ -102,51 +125,125 @@ static int m_decompressStream(lua_State *L) {
 	}
 	lua_pushlstring(L, dst, dpos);
 	allocf(ud, dst, dlen, 0);
+	if (dctx->total) zstd__updatestats(&dctx->stats, dctx->total, spos, dpos, !res, n, t0, c0); /* Input past the end of frame is not consumed */
 	if (res) return 1;
 	lua_pushliteral(L, "end");
 	return 2;
 }
 
+/* Returns number of frames in valid data */
+static int countframes(const char *buf, size_t len) {
+	size_t res;
+	int n = 0;
+	for (; len && !ZSTD_isError(res = ZSTD_findFrameCompressedSize(buf, len)); buf += res, len -= res) ++n;
+	return n;
+}
+
+/* ARG: data
+** RES: data | nil, error */
+static int m_decompress(lua_State *L) {
+	size_t res = 0, slen, spos = 0, dlen = 0, dpos = 0, blen;
+	void *ud, *buf, *dst = 0;
+	int err = 0, n = 0, frames = 0;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	DCtx *dctx = checkdctx(L, 1);
+	const void *src = luaL_checklstring(L, 2, &slen);
+	unsigned long long size = ZSTD_findDecompressedSize(src, slen); /* Known if all frames declare content size */
+	double t0 = dctx->total ? zstd__clock() : 0;
+	double c0 = dctx->total ? zstd__cpuclock() : 0;
+	if (size < ZSTD_CONTENTSIZE_ERROR && size / MAXRATIO <= slen) { /* Input and output stay stable for all frames (magicless ones are never sized) */
+		if (!(dst = allocf(ud, 0, 0, dlen = size + 1))) err = ZSTD_error_memory_allocation; /* Avoid zero-sized allocation */
+		else if (!(err = ZSTD_getErrorCode(res = ZSTD_decompressDCtx(dctx->ctx, dst, dlen, src, slen)))) {
+			dpos = res;
+			frames = countframes(src, slen);
+		}
+	} else { /* Grow output buffer as data is decompressed */
+		zstd__check(L, ZSTD_DCtx_reset(dctx->ctx, ZSTD_reset_session_only));
+		for (blen = slen << 2; ; ++n) {
+			if (!(buf = allocf(ud, dst, dlen, blen))) {
+				err = ZSTD_error_memory_allocation;
+				break;
+			}
+			dst = buf;
+			dlen = blen;
+			res = ZSTD_decompressStream_simpleArgs(dctx->ctx, dst, dlen, &dpos, src, slen, &spos);
+			if ((err = ZSTD_getErrorCode(res))) break; /* Error occurred */
+			if (!res) ++frames; /* Frame completed */
+			if (spos == slen && !res) break; /* All frames decompressed */
+			if (dpos == dlen) blen <<= 1;
+			else if (spos == slen) { /* Truncated frame */
+				err = ZSTD_error_srcSize_wrong;
+				break;
+			}
+		}
+	}
+	if (zstd__pusherror(L, err)) {
+		allocf(ud, dst, dlen, 0);
+		return 2;
+	}
+	lua_pushlstring(L, dst, dpos);
+	allocf(ud, dst, dlen, 0);
+	if (dctx->total) zstd__updatestats(&dctx->stats, dctx->total, slen, dpos, frames, n, t0, c0);
+	return 1;
+}
+
 /* ARG: data, ddict
 ** RES: data | nil, error */
 static int m_decompressBlock(lua_State *L) {
 	size_t res, slen, dlen;
 	void *ud, *dst;
 	lua_Alloc allocf = lua_getallocf(L, &ud);
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = checkdctx(L, 1);
 	const void *src = luaL_checklstring(L, 2, &slen);
 	ZSTD_DDict *ddict = checkddict(L, 3);
+	double t0 = dctx->total ? zstd__clock() : 0;
+	double c0 = dctx->total ? zstd__cpuclock() : 0;
 	int wlog;
-	zstd__check(L, ZSTD_decompressBegin_usingDDict(dctx, ddict));
-	zstd__check(L, ZSTD_DCtx_getParameter(dctx, ZSTD_d_windowLogMax, &wlog));
+	zstd__check(L, ZSTD_decompressBegin_usingDDict(dctx->ctx, ddict));
+	zstd__check(L, ZSTD_DCtx_getParameter(dctx->ctx, ZSTD_d_windowLogMax, &wlog));
 	if (wlog > ZSTD_BLOCKSIZELOG_MAX) wlog = ZSTD_BLOCKSIZELOG_MAX;
 	checkmem(L, dst = allocf(ud, 0, 0, dlen = (size_t)1 << wlog));
-	if (zstd__error(L, res = ZSTD_decompressBlock(dctx, dst, dlen, src, slen))) {
+	if (zstd__error(L, res = ZSTD_decompressBlock(dctx->ctx, dst, dlen, src, slen))) {
 		allocf(ud, dst, dlen, 0);
 		return 2;
 	}
 	lua_pushlstring(L, dst, res);
 	allocf(ud, dst, dlen, 0);
+	if (dctx->total) zstd__updatestats(&dctx->stats, dctx->total, slen, res, 0, 0, t0, c0);
 	return 1;
 }
 
+/* ARG: flag */
+static int m_setStats(lua_State *L) {
+	DCtx *dctx = checkdctx(L, 1);
+	dctx->total = lua_toboolean(L, 2) ? zstd__gettotal(L) : 0;
+	return 0;
+}
+
+/* RES: stats */
+static int m_stats(lua_State *L) {
+	DCtx *dctx = checkdctx(L, 1);
+	zstd__pushstats(L, &dctx->stats);
+	return 1;
+}
+
+static int m_resetStats(lua_State *L) {
+	DCtx *dctx = checkdctx(L, 1);
+	memset(&dctx->stats, 0, sizeof(dctx->stats));
+	return 0;
+}
+
 /* ARG: [mode] */
 static int m_reset(lua_State *L) {
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
-	int mode = zstd__checkresetmode(L, 2);
-	zstd__check(L, ZSTD_DCtx_reset(dctx, mode));
-	if (mode == ZSTD_reset_session_only) return 0; // Dictionary stays referenced
-	lua_getuservalue(L, 1);
-	lua_pushnil(L);
-	lua_rawseti(L, -2, 1);
+	zstd__resetdctx(L, 1, zstd__checkresetmode(L, 2));
 	return 0;
 }
 
 static int m__gc(lua_State *L) {
-	ZSTD_DCtx *dctx = checkdctx(L, 1);
+	DCtx *dctx = luaL_checkudata(L, 1, TYPE_DCTX);
 	lua_pushnil(L);
 	lua_setmetatable(L, 1);
-	ZSTD_freeDCtx(dctx);
+	ZSTD_freeDCtx(dctx->ctx);
 	return 0;
 }
 
@@ -154,19 +251,24 @@ static const luaL_Reg t_dctx[] = {
 	{"getParameter", m_getParameter},
 	{"setParameter", m_setParameter},
 	{"refDDict", m_refDDict},
+	{"decompress", m_decompress},
 	{"decompressStream", m_decompressStream},
 	{"decompressBlock", m_decompressBlock},
 	{"reset", m_reset},
+	{"setStats", m_setStats},
+	{"stats", m_stats},
+	{"resetStats", m_resetStats},
 	{"__gc", m__gc},
 	{0, 0}
 };
 
 /* RES: dctx */
 int zstd__newDCtx(lua_State *L) {
-	ZSTD_DCtx **dctx = lua_newuserdata(L, sizeof(*dctx));
-	checkmem(L, *dctx = ZSTD_createDCtx());
+	DCtx *dctx = lua_newuserdata(L, sizeof(*dctx));
+	memset(dctx, 0, sizeof(*dctx));
+	checkmem(L, dctx->ctx = ZSTD_createDCtx());
 	lua_createtable(L, 1, 0);
-	lua_setuservalue(L, 1);
+	lua_setuservalue(L, -2);
 	if (luaL_newmetatable(L, TYPE_DCTX)) {
 		lua_pushboolean(L, 0);
 		lua_setfield(L, -2, "__metatable");
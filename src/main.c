@@ -20,6 +20,7 @@
 ** THE SOFTWARE.
 */
 
+#include <string.h>
 #include "common.h"
 
 static int getlen(lua_State *L, const void *buf, size_t slen, size_t *dlen) {
@@ -38,18 +39,23 @@ static int getlen(lua_State *L, const void *buf, size_t slen, size_t *dlen) {
 	return 1;
 }
 
-/* ARG: data, [level]
-** RES: data | nil, error */
+/* ARG: data, [level], [probe]
+** RES: data, [mode] | nil, error */
 static int f_compress(lua_State *L) {
 	size_t slen;
 	const void *src = luaL_checklstring(L, 1, &slen);
 	int level = luaL_optinteger(L, 2, 0);
+	int probe = lua_toboolean(L, 3);
+	int stored = probe && zstd__probe(L, src, slen);
 	size_t dlen = ZSTD_compressBound(slen);
 	void *dst;
 	checkrange(L, level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel(), 2);
+	if (stored) level = ZSTD_minCLevel(); /* Skip match finding, emit raw blocks */
 	if (zstd__error(L, dlen = ZSTD_compress(dst = lua_newuserdata(L, dlen), dlen, src, slen, level))) return 2;
 	lua_pushlstring(L, dst, dlen);
-	return 1;
+	if (!probe) return 1;
+	lua_pushstring(L, stored ? "stored" : "compressed");
+	return 2;
 }
 
 /* ARG: data
@@ -83,16 +89,114 @@ static int f_getFrameContentSize(lua_State *L) {
 	return 1;
 }
 
+/* ARG: data
+** RES: header | nil, error */
+static int f_getFrameHeader(lua_State *L) {
+	size_t len, res;
+	const void *buf = luaL_checklstring(L, 1, &len);
+	ZSTD_frameHeader zfh;
+	if (zstd__error(L, res = ZSTD_getFrameHeader(&zfh, buf, len))) return 2;
+	if (res) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "incomplete frame header");
+		return 2;
+	}
+	lua_createtable(L, 0, 7);
+	if (zfh.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN) {
+		lua_pushinteger(L, zfh.frameContentSize);
+		lua_setfield(L, -2, "frameContentSize");
+	}
+	lua_pushinteger(L, zfh.windowSize);
+	lua_setfield(L, -2, "windowSize");
+	lua_pushinteger(L, zfh.blockSizeMax);
+	lua_setfield(L, -2, "blockSizeMax");
+	lua_pushstring(L, zfh.frameType == ZSTD_skippableFrame ? "skippable" : "frame");
+	lua_setfield(L, -2, "frameType");
+	lua_pushinteger(L, zfh.headerSize);
+	lua_setfield(L, -2, "headerSize");
+	lua_pushinteger(L, zfh.dictID);
+	lua_setfield(L, -2, "dictID");
+	lua_pushboolean(L, zfh.checksumFlag);
+	lua_setfield(L, -2, "checksumFlag");
+	return 1;
+}
+
+/* UPV: data, pos
+** RES: pos, size, type */
+static int f_nextFrame(lua_State *L) {
+	size_t len, res;
+	const char *buf = lua_tolstring(L, lua_upvalueindex(1), &len);
+	size_t pos = lua_tointeger(L, lua_upvalueindex(2));
+	ZSTD_frameHeader zfh;
+	if (pos >= len) return 0;
+	zstd__check(L, res = ZSTD_getFrameHeader(&zfh, buf + pos, len - pos));
+	if (res) {
+		lua_pushinteger(L, pos + 1); /* Format as integer of any size */
+		luaL_error(L, "incomplete frame header at position %s", lua_tostring(L, -1));
+	}
+	zstd__check(L, res = ZSTD_findFrameCompressedSize(buf + pos, len - pos));
+	lua_pushinteger(L, pos + res);
+	lua_replace(L, lua_upvalueindex(2));
+	lua_pushinteger(L, pos + 1);
+	lua_pushinteger(L, res);
+	lua_pushstring(L, zfh.frameType == ZSTD_skippableFrame ? "skippable" : "frame");
+	return 3;
+}
+
+/* ARG: data
+** RES: iterator */
+static int f_frames(lua_State *L) {
+	luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, f_nextFrame, 2);
+	return 1;
+}
+
+/* ARG: data
+** RES: size | nil, error */
+static int f_decompressBound(lua_State *L) {
+	size_t len;
+	const void *buf = luaL_checklstring(L, 1, &len);
+	unsigned long long size = ZSTD_decompressBound(buf, len);
+	if (size == ZSTD_CONTENTSIZE_ERROR) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "invalid frame data");
+		return 2;
+	}
+	lua_pushinteger(L, size);
+	return 1;
+}
+
+/* RES: stats */
+static int f_stats(lua_State *L) {
+	zstd__pushstats(L, zstd__gettotal(L));
+	return 1;
+}
+
+static int f_resetStats(lua_State *L) {
+	memset(zstd__gettotal(L), 0, sizeof(Stats));
+	return 0;
+}
+
 static const luaL_Reg l_zstd[] = {
 	{"compress", f_compress},
 	{"decompress", f_decompress},
 	{"isFrame", f_isFrame},
 	{"getFrameContentSize", f_getFrameContentSize},
+	{"getFrameHeader", f_getFrameHeader},
+	{"frames", f_frames},
+	{"decompressBound", f_decompressBound},
+	{"stats", f_stats},
+	{"resetStats", f_resetStats},
+	{"tune", zstd__tune},
 	{"CCtx", zstd__newCCtx},
 	{"CCtxParams", zstd__newCCtxParams},
 	{"CDict", zstd__newCDict},
 	{"DCtx", zstd__newDCtx},
 	{"DDict", zstd__newDDict},
+	{"Pool", zstd__newPool},
+	{"Chunker", zstd__newChunker},
 	{0, 0}
 };
 
@@ -0,0 +1,206 @@
+/*
+** Copyright (C) 2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "common.h"
+
+typedef struct {
+	size_t budget, size; /* Memory budget and memory held by idle contexts */
+	int n[2], lo[2]; /* Per list: number of idle contexts, first one with workspace */
+} Pool;
+
+#define checkpool(L, arg) ((Pool *)luaL_checkudata(L, arg, TYPE_POOL))
+
+static int istype(lua_State *L, int arg, const char *tname) {
+	int res;
+	if (!lua_getmetatable(L, arg)) return 0;
+	luaL_getmetatable(L, tname);
+	res = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return res;
+}
+
+static size_t sizeofctx(lua_State *L, int arg, int type) {
+	if (type) return ZSTD_sizeof_DCtx(((DCtx *)lua_touserdata(L, arg))->ctx);
+	return ZSTD_sizeof_CCtx(((CCtx *)lua_touserdata(L, arg))->ctx);
+}
+
+/* Frees workspaces of least recently returned contexts until idle memory fits 'budget' */
+static void trim(lua_State *L, Pool *pool, size_t budget) {
+	int type;
+	lua_getuservalue(L, 1);
+	for (type = 0; type < 2 && pool->size > budget; ++type) {
+		lua_rawgeti(L, -1, type + 1);
+		for (; pool->lo[type] <= pool->n[type] && pool->size > budget; ++pool->lo[type]) {
+			lua_rawgeti(L, -1, pool->lo[type]);
+			pool->size -= sizeofctx(L, -1, type);
+			if (type) {
+				DCtx *dctx = lua_touserdata(L, -1);
+				ZSTD_freeDCtx(dctx->ctx);
+				dctx->ctx = 0;
+			} else {
+				CCtx *cctx = lua_touserdata(L, -1);
+				ZSTD_freeCCtx(cctx->ctx);
+				cctx->ctx = 0;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/* Pops an idle context of 'type' or creates a new one */
+static void get(lua_State *L, Pool *pool, int type) {
+	int n = pool->n[type];
+	if (!n) {
+		if (type) zstd__newDCtx(L);
+		else zstd__newCCtx(L);
+		return;
+	}
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, type + 1);
+	lua_rawgeti(L, -1, n);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, n);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	pool->size -= sizeofctx(L, -1, type);
+	pool->n[type] = --n;
+	if (pool->lo[type] > n + 1) pool->lo[type] = n + 1;
+	if (type) ((DCtx *)lua_touserdata(L, -1))->idle = 0;
+	else ((CCtx *)lua_touserdata(L, -1))->idle = 0;
+}
+
+/* RES: cctx */
+static int m_CCtx(lua_State *L) {
+	Pool *pool = checkpool(L, 1);
+	lua_settop(L, 1);
+	get(L, pool, 0);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 3);
+	if (!lua_isnil(L, -1)) zstd__check(L, ZSTD_CCtx_setParametersUsingCCtxParams(checkcctx(L, 2)->ctx, checkcctxparams(L, -1)));
+	lua_settop(L, 2);
+	return 1;
+}
+
+/* RES: dctx */
+static int m_DCtx(lua_State *L) {
+	Pool *pool = checkpool(L, 1);
+	lua_settop(L, 1);
+	get(L, pool, 1);
+	return 1;
+}
+
+/* ARG: ctx */
+static int m_put(lua_State *L) {
+	Pool *pool = checkpool(L, 1);
+	int type, n;
+	lua_settop(L, 2);
+	if (istype(L, 2, TYPE_CCTX)) {
+		CCtx *cctx = lua_touserdata(L, 2);
+		luaL_argcheck(L, !cctx->idle, 2, "context already in pool");
+		if (cctx->ctx) zstd__resetcctx(L, 2, ZSTD_reset_session_and_parameters); /* Freed workspace hasn't been used since last reset */
+		memset(&cctx->stats, 0, sizeof(cctx->stats));
+		cctx->total = 0;
+		cctx->idle = 1;
+		type = 0;
+	} else if (istype(L, 2, TYPE_DCTX)) {
+		DCtx *dctx = lua_touserdata(L, 2);
+		luaL_argcheck(L, !dctx->idle, 2, "context already in pool");
+		if (dctx->ctx) zstd__resetdctx(L, 2, ZSTD_reset_session_and_parameters); /* Freed workspace hasn't been used since last reset */
+		memset(&dctx->stats, 0, sizeof(dctx->stats));
+		dctx->total = 0;
+		dctx->idle = 1;
+		type = 1;
+	} else return luaL_argerror(L, 2, "context expected");
+	n = ++pool->n[type];
+	pool->size += sizeofctx(L, 2, type);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, type + 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, n);
+	lua_pop(L, 2);
+	trim(L, pool, pool->budget);
+	return 0;
+}
+
+/* ARG: [budget] */
+static int m_trim(lua_State *L) {
+	Pool *pool = checkpool(L, 1);
+	lua_Integer budget = luaL_optinteger(L, 2, 0);
+	checkrange(L, budget >= 0, 2);
+	trim(L, pool, budget);
+	return 0;
+}
+
+/* RES: size */
+static int m_getMemory(lua_State *L) {
+	Pool *pool = checkpool(L, 1);
+	lua_pushinteger(L, pool->size);
+	return 1;
+}
+
+static const luaL_Reg t_pool[] = {
+	{"CCtx", m_CCtx},
+	{"DCtx", m_DCtx},
+	{"put", m_put},
+	{"trim", m_trim},
+	{"getMemory", m_getMemory},
+	{0, 0}
+};
+
+/* ARG: budget, [cctxparams]
+** RES: pool */
+int zstd__newPool(lua_State *L) {
+	lua_Integer budget = luaL_checkinteger(L, 1);
+	Pool *pool;
+	checkrange(L, budget >= 0, 1);
+	if (!lua_isnoneornil(L, 2)) luaL_checkudata(L, 2, TYPE_CCTXPARAMS);
+	lua_settop(L, 2);
+	pool = lua_newuserdata(L, sizeof(*pool));
+	pool->budget = budget;
+	pool->size = 0;
+	pool->n[0] = pool->n[1] = 0;
+	pool->lo[0] = pool->lo[1] = 1;
+	lua_createtable(L, 3, 0);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 1);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 2);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 3);
+	lua_setuservalue(L, -2);
+	if (luaL_newmetatable(L, TYPE_POOL)) {
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "__metatable");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+		luaL_register(L, 0, t_pool);
+#else
+		luaL_setfuncs(L, t_pool, 0);
+#endif
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
@@ -0,0 +1,89 @@
+/*
+** Copyright (C) 2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "common.h"
+
+/* ARG: index
+** RES: offset, litLength, matchLength, rep */
+static int m_get(lua_State *L) {
+	Sequences *seqs = checksequences(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	ZSTD_Sequence *seq;
+	checkrange(L, i >= 1 && (size_t)i <= seqs->n, 2);
+	seq = &seqs->seq[i - 1];
+	lua_pushinteger(L, seq->offset);
+	lua_pushinteger(L, seq->litLength);
+	lua_pushinteger(L, seq->matchLength);
+	lua_pushinteger(L, seq->rep);
+	return 4;
+}
+
+static int m_mergeBlockDelimiters(lua_State *L) {
+	Sequences *seqs = checksequences(L, 1);
+	if (!seqs->delim) return 0;
+	seqs->n = ZSTD_mergeBlockDelimiters(seqs->seq, seqs->n);
+	seqs->delim = 0;
+	return 0;
+}
+
+/* RES: count */
+static int m__len(lua_State *L) {
+	Sequences *seqs = checksequences(L, 1);
+	lua_pushinteger(L, seqs->n);
+	return 1;
+}
+
+static const luaL_Reg t_sequences[] = {
+	{"get", m_get},
+	{"mergeBlockDelimiters", m_mergeBlockDelimiters},
+	{"__len", m__len},
+	{0, 0}
+};
+
+/* ARG: data (at the top of the stack)
+** RES: sequences */
+Sequences *zstd__newSequences(lua_State *L, const ZSTD_Sequence *seq, size_t n) {
+	Sequences *seqs = lua_newuserdata(L, sizeof(*seqs) + n * sizeof(*seq));
+	size_t i;
+	seqs->n = n;
+	seqs->delim = 1;
+	memcpy(seqs->seq, seq, n * sizeof(*seq));
+	for (i = 0; i < n; ++i) if (!seqs->seq[i].offset && !seqs->seq[i].matchLength) seqs->seq[i].rep = 0; /* Left undefined for block delimiters */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, -3);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, -2);
+	if (luaL_newmetatable(L, TYPE_SEQUENCES)) {
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "__metatable");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM < 502
+		luaL_register(L, 0, t_sequences);
+#else
+		luaL_setfuncs(L, t_sequences, 0);
+#endif
+	}
+	lua_setmetatable(L, -2);
+	return seqs;
+}
@@ -0,0 +1,284 @@
+/*
+** Copyright (C) 2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+#define NPARAM 12
+#define LDM 7 /* Index of LDM switch, followed by LDM parameters */
+#define MAXCONF 256 /* Maximum number of measured configurations */
+#define MINTIME 0.05 /* Minimum time of a single measurement */
+#define MAXLOG 27 /* Upper limit of table/window logs to keep memory sane */
+
+static const char *const s_param[] = {
+	"windowLog",
+	"chainLog",
+	"hashLog",
+	"searchLog",
+	"minMatch",
+	"targetLength",
+	"strategy",
+	"enableLongDistanceMatching",
+	"ldmHashLog",
+	"ldmMinMatch",
+	"ldmBucketSizeLog",
+	"ldmHashRateLog",
+};
+
+static const ZSTD_cParameter v_param[] = {
+	ZSTD_c_windowLog,
+	ZSTD_c_chainLog,
+	ZSTD_c_hashLog,
+	ZSTD_c_searchLog,
+	ZSTD_c_minMatch,
+	ZSTD_c_targetLength,
+	ZSTD_c_strategy,
+	ZSTD_c_enableLongDistanceMatching,
+	ZSTD_c_ldmHashLog,
+	ZSTD_c_ldmMinMatch,
+	ZSTD_c_ldmBucketSizeLog,
+	ZSTD_c_ldmHashRateLog,
+};
+
+static const char *const s_target[] = {
+	"ratio",
+	"speed",
+	0
+};
+
+typedef struct {
+	int p[NPARAM];
+	double speed, ratio; /* MB/s, input/output */
+} Config;
+
+typedef struct {
+	ZSTD_CCtx *cctx;
+	const char **src;
+	size_t *len, n, dlen;
+	void *dst;
+	int target, ntab;
+	double minSpeed, minRatio, deadline;
+	Config tab[MAXCONF];
+} Tuner;
+
+/* Returns libzstd value of parameter 'k' (LDM is searched as a plain on/off switch) */
+static int value(const Config *c, int k) {
+#if ZSTD_VERSION_NUMBER >= 10501
+	if (k == LDM) return c->p[k] ? ZSTD_ps_enable : ZSTD_ps_disable; /* Not 'auto' */
+#endif
+	return c->p[k];
+}
+
+static int measure(Tuner *t, Config *c) {
+	size_t i, res, in = 0, out = 0;
+	double t0, t1;
+	int k;
+	ZSTD_CCtx_reset(t->cctx, ZSTD_reset_session_and_parameters);
+	for (k = 0; k < NPARAM; ++k) {
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(t->cctx, v_param[k], value(c, k)))) return 0;
+	}
+	t0 = zstd__clock();
+	do {
+		for (i = 0; i < t->n; ++i) {
+			if (ZSTD_isError(res = ZSTD_compress2(t->cctx, t->dst, t->dlen, t->src[i], t->len[i]))) return 0;
+			in += t->len[i];
+			out += res;
+		}
+		t1 = zstd__clock();
+	} while (t1 - t0 < MINTIME);
+	c->speed = in / (t1 - t0) / 1e6;
+	c->ratio = (double)in / out;
+	return 1;
+}
+
+static int feasible(const Tuner *t, const Config *c) {
+	return c->speed >= t->minSpeed && c->ratio >= t->minRatio;
+}
+
+/* Relative distance to violated constraints */
+static double shortfall(const Tuner *t, const Config *c) {
+	double d = 0;
+	if (c->speed < t->minSpeed) d += 1 - c->speed / t->minSpeed;
+	if (c->ratio < t->minRatio) d += 1 - c->ratio / t->minRatio;
+	return d;
+}
+
+/* Is 'a' better than 'b'? */
+static int better(const Tuner *t, const Config *a, const Config *b) {
+	int fa = feasible(t, a), fb = feasible(t, b);
+	if (fa != fb) return fa;
+	if (!fa && shortfall(t, a) != shortfall(t, b)) return shortfall(t, a) < shortfall(t, b); /* Get closer to whichever constraint fails */
+	if (t->target) return a->speed > b->speed || (a->speed == b->speed && a->ratio > b->ratio);
+	return a->ratio > b->ratio || (a->ratio == b->ratio && a->speed > b->speed);
+}
+
+/* Measures configuration and returns its index or -1 */
+static int add(Tuner *t, const Config *c) {
+	int i;
+	if (t->ntab == MAXCONF || zstd__clock() > t->deadline) return -1;
+	for (i = 0; i < t->ntab; ++i) {
+		if (!memcmp(t->tab[i].p, c->p, sizeof(c->p))) return -1; /* Already visited */
+	}
+	t->tab[i] = *c;
+	if (!measure(t, &t->tab[i])) return -1;
+	return t->ntab++;
+}
+
+/* Returns a neighbouring value of parameter 'k' in direction 'dir' */
+static int step(const Config *c, int k, int dir) {
+	ZSTD_bounds b = ZSTD_cParam_getBounds(v_param[k]);
+	int val = c->p[k];
+	if (v_param[k] == ZSTD_c_targetLength) val = dir > 0 ? (val ? val << 1 : 1) : val >> 1;
+	else val += dir;
+	if (k == LDM) b.lowerBound = 0, b.upperBound = 1;
+	if ((k < 3 || k == LDM + 1) && b.upperBound > MAXLOG) b.upperBound = MAXLOG;
+	if (val < b.lowerBound) val = b.lowerBound;
+	if (val > b.upperBound) val = b.upperBound;
+	return val;
+}
+
+static void search(Tuner *t, size_t hint) {
+	int i, k, dir, best = -1, improved = 1;
+	for (i = t->target ? -5 : 1; i <= 19; ++i) { /* Sweep regular levels */
+		ZSTD_compressionParameters cp = ZSTD_getCParams(i, hint, 0);
+		Config c = {{cp.windowLog, cp.chainLog, cp.hashLog, cp.searchLog, cp.minMatch, cp.targetLength, cp.strategy, 0, 0, 0, 0, 0}, 0, 0};
+		if (!i || (k = add(t, &c)) == -1) continue;
+		if (best == -1 || better(t, &t->tab[k], &t->tab[best])) best = k;
+	}
+	while (best != -1 && improved) { /* Climb from the best level */
+		improved = 0;
+		for (k = 0; k < NPARAM; ++k) {
+			for (dir = -1; dir <= 1; dir += 2) {
+				Config c = t->tab[best];
+				if (k > LDM && !c.p[LDM]) break; /* LDM parameters have no effect */
+				if ((c.p[k] = step(&c, k, dir)) == t->tab[best].p[k]) continue;
+				if (k == LDM && c.p[k]) { /* Start from libzstd defaults */
+					c.p[LDM + 1] = c.p[0] - 7 > ZSTD_LDM_HASHLOG_MIN ? c.p[0] - 7 : ZSTD_LDM_HASHLOG_MIN;
+					c.p[LDM + 2] = 64;
+					c.p[LDM + 3] = 3;
+					c.p[LDM + 4] = c.p[0] - c.p[LDM + 1];
+				} else if (k == LDM) memset(c.p + LDM + 1, 0, (NPARAM - LDM - 1) * sizeof(*c.p));
+				if ((i = add(t, &c)) == -1) continue;
+				if (!better(t, &t->tab[i], &t->tab[best])) continue;
+				best = i;
+				improved = 1;
+			}
+		}
+	}
+	if (best > 0) { /* Keep the best configuration first */
+		Config c = t->tab[0];
+		t->tab[0] = t->tab[best];
+		t->tab[best] = c;
+	}
+}
+
+static int cmpspeed(const void *a, const void *b) {
+	double x = ((const Config *)a)->speed, y = ((const Config *)b)->speed;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void pushconfig(lua_State *L, const Config *c) {
+	int k;
+	lua_createtable(L, 0, NPARAM + 2);
+	lua_pushnumber(L, c->speed);
+	lua_setfield(L, -2, "speed");
+	lua_pushnumber(L, c->ratio);
+	lua_setfield(L, -2, "ratio");
+	for (k = 0; k < NPARAM; ++k) {
+		lua_pushinteger(L, c->p[k]);
+		lua_setfield(L, -2, s_param[k]);
+	}
+}
+
+/* Pushes speed/ratio frontier sorted by speed */
+static void pushfrontier(lua_State *L, Tuner *t) {
+	int i, j, n = 0;
+	qsort(t->tab, t->ntab, sizeof(*t->tab), cmpspeed);
+	lua_newtable(L);
+	for (i = 0; i < t->ntab; ++i) {
+		for (j = 0; j < i && t->tab[j].ratio < t->tab[i].ratio; ++j);
+		if (j < i) continue; /* Dominated by a faster configuration */
+		pushconfig(L, &t->tab[i]);
+		lua_rawseti(L, -2, ++n);
+	}
+}
+
+static double optnumber(lua_State *L, const char *name, double def) {
+	double val = def;
+	lua_getfield(L, 2, name);
+	if (!lua_isnil(L, -1) && (lua_type(L, -1) != LUA_TNUMBER || (val = lua_tonumber(L, -1)) < 0)) luaL_error(L, "invalid option '%s'", name);
+	lua_pop(L, 1);
+	return val;
+}
+
+/* ARG: samples, [options]
+** RES: cctxparams, frontier */
+int zstd__tune(lua_State *L) {
+	size_t i, n = 1, hint = 0, max = 0;
+	Tuner *t;
+	ZSTD_CCtx_params *params;
+	const char *name;
+	double secs;
+	int k;
+	if (lua_type(L, 1) == LUA_TTABLE) n = lua_rawlen(L, 1);
+	else luaL_checkstring(L, 1);
+	luaL_argcheck(L, n, 1, "no samples");
+	if (lua_isnoneornil(L, 2)) lua_newtable(L);
+	else luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	t = lua_newuserdata(L, sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	t->src = lua_newuserdata(L, n * sizeof(*t->src));
+	t->len = lua_newuserdata(L, n * sizeof(*t->len));
+	for (t->n = n, i = 0; i < n; ++i) {
+		if (lua_type(L, 1) == LUA_TTABLE) lua_rawgeti(L, 1, i + 1);
+		else lua_pushvalue(L, 1);
+		if (lua_type(L, -1) != LUA_TSTRING) luaL_argerror(L, 1, "string expected");
+		t->src[i] = lua_tolstring(L, -1, &t->len[i]); /* Anchored in argument */
+		lua_pop(L, 1);
+		if (max < t->len[i]) max = t->len[i];
+		hint += t->len[i];
+	}
+	hint /= n;
+	lua_getfield(L, 2, "target");
+	name = lua_isnil(L, -1) ? s_target[0] : lua_tostring(L, -1);
+	for (k = 0; name && s_target[k] && strcmp(name, s_target[k]); ++k);
+	if (!name || !s_target[k]) luaL_error(L, "invalid option 'target'");
+	lua_pop(L, 1);
+	t->target = k;
+	t->minSpeed = optnumber(L, "minSpeed", 0);
+	t->minRatio = optnumber(L, "minRatio", 0);
+	secs = optnumber(L, "time", 10);
+	t->dst = lua_newuserdata(L, t->dlen = ZSTD_compressBound(max));
+	checkmem(L, t->cctx = ZSTD_createCCtx());
+	t->deadline = zstd__clock() + secs;
+	search(t, hint);
+	ZSTD_freeCCtx(t->cctx);
+	zstd__newCCtxParams(L);
+	params = checkcctxparams(L, -1);
+	if (t->ntab) {
+		for (k = 0; k < NPARAM; ++k) zstd__check(L, ZSTD_CCtxParams_setParameter(params, v_param[k], value(&t->tab[0], k)));
+	}
+	pushfrontier(L, t);
+	return 2;
+}
@@ -20,8 +20,15 @@
 ** THE SOFTWARE.
 */
 
+#include <string.h>
 #include "common.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 int zstd__pusherror(lua_State *L, int err) {
 	if (!err) return 0;
 	lua_pushnil(L);
@@ -37,6 +44,101 @@ void zstd__check(lua_State *L, size_t res) {
 	if (zstd__error(L, res)) lua_error(L);
 }
 
+/* Monotonic wall clock in seconds */
+double zstd__clock(void) {
+#ifdef _WIN32
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (double)t.QuadPart / f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* Current thread CPU time in seconds */
+double zstd__cpuclock(void) {
+#ifdef _WIN32
+	FILETIME c, e, k, u;
+	GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u);
+	return ((((unsigned long long)k.dwHighDateTime << 32) | k.dwLowDateTime) + (((unsigned long long)u.dwHighDateTime << 32) | u.dwLowDateTime)) * 1e-7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* Module-wide statistics live in the registry */
+Stats *zstd__gettotal(lua_State *L) {
+	Stats *total;
+	lua_getfield(L, LUA_REGISTRYINDEX, TYPE_STATS);
+	if (!(total = lua_touserdata(L, -1))) {
+		memset(total = lua_newuserdata(L, sizeof(*total)), 0, sizeof(*total));
+		lua_setfield(L, LUA_REGISTRYINDEX, TYPE_STATS);
+	}
+	lua_pop(L, 1);
+	return total;
+}
+
+void zstd__pushstats(lua_State *L, const Stats *stats) {
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, stats->in);
+	lua_setfield(L, -2, "bytesIn");
+	lua_pushinteger(L, stats->out);
+	lua_setfield(L, -2, "bytesOut");
+	lua_pushinteger(L, stats->calls);
+	lua_setfield(L, -2, "calls");
+	lua_pushinteger(L, stats->frames);
+	lua_setfield(L, -2, "frames");
+	lua_pushinteger(L, stats->growths);
+	lua_setfield(L, -2, "growths");
+	lua_pushnumber(L, stats->wall);
+	lua_setfield(L, -2, "wallTime");
+	lua_pushnumber(L, stats->cpu);
+	lua_setfield(L, -2, "cpuTime");
+}
+
+static void addstats(Stats *stats, const Stats *delta) {
+	stats->in += delta->in;
+	stats->out += delta->out;
+	stats->calls += delta->calls;
+	stats->frames += delta->frames;
+	stats->growths += delta->growths;
+	stats->wall += delta->wall;
+	stats->cpu += delta->cpu;
+}
+
+/* ARG: wall, cpu - clock values at the start of a call */
+void zstd__updatestats(Stats *stats, Stats *total, size_t in, size_t out, int frames, int growths, double wall, double cpu) {
+	Stats delta = {in, out, 1, frames, growths, zstd__clock() - wall, zstd__cpuclock() - cpu};
+	addstats(stats, &delta);
+	addstats(total, &delta);
+}
+
+#define PROBE_CHUNK 2048
+#define PROBE_CHUNKS 8
+
+/* Estimates compressibility by compressing evenly spaced samples of data at the fastest level.
+** Returns 1 if data is unlikely to compress (e.g. already compressed media or encrypted blobs). */
+int zstd__probe(lua_State *L, const void *buf, size_t len) {
+	size_t i, res, n = len / PROBE_CHUNK, slen, dlen;
+	void *ud;
+	char *src;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	if (!n) return 0; /* Too small to bother */
+	if (n > PROBE_CHUNKS) n = PROBE_CHUNKS;
+	slen = n * PROBE_CHUNK;
+	dlen = ZSTD_compressBound(slen);
+	if (!(src = allocf(ud, 0, 0, slen + dlen))) return 0;
+	for (i = 0; i < n; ++i) memcpy(src + i * PROBE_CHUNK, (const char *)buf + (len - PROBE_CHUNK) / n * i, PROBE_CHUNK);
+	res = ZSTD_compress(src + slen, dlen, src, slen, 1);
+	allocf(ud, src, slen + dlen, 0);
+	return !ZSTD_isError(res) && res > slen - slen / 64;
+}
+
 static const char *const s_reset[] = {
 	"session",
 	"params",
@@ -0,0 +1,232 @@
+/*
+** Copyright (C) 2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+/*
+** Fuzzing harness for stream loops of the module. Input is compressed and decompressed chunk by chunk
+** through an embedded Lua state, results are compared with one-shot libzstd calls, and a run is aborted
+** if a call allocates or takes more than its bound (e.g. due to quadratic buffer growth).
+**
+** Input layout: compression level, chunk size, stream operation mode, payload. With LIBFUZZER defined,
+** the fuzzing engine provides 'main'. Otherwise, files given as arguments are run (e.g. AFL with '@@'),
+** or a built-in set of regression inputs if there are none.
+*/
+
+#define ZSTD_STATIC_LINKING_ONLY /* Enable ZSTD_decompressBound() */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <zstd.h>
+
+#define MAXLEVEL 12 /* Highest compression level used */
+#define MAXALLOCS 8 /* Allocations per call (plus logarithm of output size) */
+#define MAXTIME 0.25 /* Time per call in seconds (plus time per byte) */
+#define MAXBYTETIME 1e-6
+#define MAXWINDOWLOG 20 /* Window size limit for decompression of raw input */
+#define MAXBOUND (1 << (MAXWINDOWLOG + 4)) /* Output size limit for decompression of raw input */
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+int luaopen_zstd(lua_State *L);
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len);
+
+static const char script[] =
+	"local zstd, measure, level, size, mode, data, frame = ...\n"
+	"local ops = {'continue', 'flush', 'end'}\n"
+	"local cctx = zstd.CCtx()\n"
+	"local dctx = zstd.DCtx()\n"
+	"local t = {}\n"
+	"cctx:setParameter('compressionLevel', level)\n"
+	"for i = 1, #data, size do\n" /* Compress payload as a stream */
+	"	local op = ops[mode < 3 and mode + 1 or #t % 3 + 1]\n"
+	"	t[#t + 1] = assert(measure(cctx.compressStream, cctx, data:sub(i, i + size - 1), op))\n"
+	"end\n"
+	"t[#t + 1] = assert(measure(cctx.compressStream, cctx, '', 'end'))\n"
+	"local comp = table.concat(t)\n"
+	"t = {}\n"
+	"for i = 1, #frame, size do\n" /* Decompress one-shot frame as a stream */
+	"	t[#t + 1] = assert(measure(dctx.decompressStream, dctx, frame:sub(i, i + size - 1)))\n"
+	"end\n"
+	"local decomp = table.concat(t)\n"
+	"if #data == 0 then return comp, decomp end\n"
+	"dctx = zstd.DCtx()\n" /* Decompress payload as is */
+	"dctx:setParameter('windowLogMax', " STR(MAXWINDOWLOG) ")\n"
+	"return comp, decomp, (measure(dctx.decompressStream, dctx, data))\n";
+
+static size_t allocs; /* Number of allocations that grow memory */
+
+static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	if (!nsize) {
+		free(ptr);
+		return 0;
+	}
+	if (!ptr || nsize > osize) ++allocs;
+	return realloc(ptr, nsize);
+}
+
+static void fail(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	abort();
+}
+
+/* ARG: func, obj, data, ...
+** RES: ... */
+static int measure(lua_State *L) {
+	size_t n = allocs, len, out = 0, l;
+	clock_t t = clock();
+	double dt;
+	int i, top;
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_checklstring(L, 3, &len);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	dt = (double)(clock() - t) / CLOCKS_PER_SEC;
+	n = allocs - n;
+	for (i = 1, top = lua_gettop(L); i <= top; ++i) if (lua_type(L, i) == LUA_TSTRING && lua_tolstring(L, i, &l)) out += l;
+	if (n > MAXALLOCS + log2(1 + out / 100.)) fail("%u allocations for %u -> %u bytes", (unsigned)n, (unsigned)len, (unsigned)out);
+	if (dt > MAXTIME + MAXBYTETIME * (len + out)) fail("%.3f seconds for %u -> %u bytes", dt, (unsigned)len, (unsigned)out);
+	return top;
+}
+
+static void check(const void *buf, size_t len, const char *res, size_t rlen, const char *what) {
+	if (!res) fail("%s: no result", what);
+	if (rlen != len || memcmp(res, buf, len)) fail("%s: %u bytes instead of %u", what, (unsigned)rlen, (unsigned)len);
+}
+
+static void run(const uint8_t *buf, size_t len) {
+	int level, size, mode;
+	size_t res, flen, clen, dlen, glen;
+	unsigned long long bound;
+	const char *comp, *decomp, *garb;
+	void *frame, *dst, *out;
+	ZSTD_DCtx *dctx;
+	lua_State *L;
+	if (len < 3) return;
+	level = buf[0] % (MAXLEVEL + 6) - 5;
+	size = 1 << buf[1] % 17;
+	mode = buf[2] % 4; /* 'continue', 'flush', 'end' or all in turn */
+	buf += 3;
+	len -= 3;
+	if (!(frame = malloc(flen = ZSTD_compressBound(len))) || !(dst = malloc(len + 1))) fail("not enough memory");
+	if (ZSTD_isError(flen = ZSTD_compress(frame, flen, buf, len, level))) fail("%s", ZSTD_getErrorName(flen));
+	if (!(L = lua_newstate(alloc, 0))) fail("can't create Lua state"); /* 64-bit LuaJIT doesn't support custom allocators */
+	luaL_openlibs(L);
+	if (luaL_loadbuffer(L, script, sizeof(script) - 1, "fuzz")) fail("%s", lua_tostring(L, -1));
+	lua_pushcfunction(L, luaopen_zstd);
+	lua_call(L, 0, 1);
+	lua_pushcfunction(L, measure);
+	lua_pushinteger(L, level);
+	lua_pushinteger(L, size);
+	lua_pushinteger(L, mode);
+	lua_pushlstring(L, (const char *)buf, len);
+	lua_pushlstring(L, frame, flen);
+	if (lua_pcall(L, 7, 3, 0)) fail("%s", lua_tostring(L, -1));
+	comp = lua_tolstring(L, -3, &clen);
+	decomp = lua_tolstring(L, -2, &dlen);
+	garb = lua_tolstring(L, -1, &glen);
+	res = ZSTD_decompress(dst, len + 1, comp, clen); /* Stream may consist of many frames */
+	if (ZSTD_isError(res)) fail("stream: %s", ZSTD_getErrorName(res));
+	check(buf, len, dst, res, "stream");
+	check(buf, len, decomp, dlen, "frame");
+	if (len && ZSTD_findFrameCompressedSize(buf, len) == len && (bound = ZSTD_decompressBound(buf, len)) <= MAXBOUND) { /* Payload is a single valid frame */
+		if (!(dctx = ZSTD_createDCtx()) || !(out = malloc(bound + 1))) fail("not enough memory");
+		ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, MAXWINDOWLOG);
+		if (!ZSTD_isError(res = ZSTD_decompressDCtx(dctx, out, bound + 1, buf, len))) check(out, res, garb, glen, "payload");
+		ZSTD_freeDCtx(dctx);
+		free(out);
+	}
+	lua_close(L);
+	free(dst);
+	free(frame);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+	run(buf, len);
+	return 0;
+}
+
+#ifndef LIBFUZZER
+
+static void runfile(const char *name) {
+	size_t len = 0, res;
+	uint8_t *buf = 0, *tmp;
+	FILE *f = fopen(name, "rb");
+	if (!f) fail("can't open '%s'", name);
+	do {
+		if (!(tmp = realloc(buf, len + 65536))) fail("not enough memory");
+		buf = tmp;
+		len += res = fread(buf + len, 1, 65536, f);
+	} while (res);
+	fclose(f);
+	run(buf, len);
+	free(buf);
+}
+
+/* Regression inputs: payload kinds (zeros, noise, text, alternating runs) of various sizes */
+static void runall(void) {
+	static const size_t sizes[] = {0, 1, 100, 65536, 1 << 20};
+	size_t i, j, k, len;
+	uint32_t x = 1;
+	uint8_t *buf;
+	if (!(buf = malloc(3 + (1 << 20)))) fail("not enough memory");
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < sizeof(sizes) / sizeof(*sizes); ++j) {
+			len = sizes[j];
+			for (k = 0; k < len; ++k) {
+				x = x * 1103515245 + 12345;
+				switch (i) {
+					case 0: buf[3 + k] = 0; break;
+					case 1: buf[3 + k] = x >> 24; break;
+					case 2: buf[3 + k] = "lorem ipsum dolor sit amet "[(k + (x >> 28)) % 27]; break;
+					default: buf[3 + k] = (k >> 10) & 1 ? x >> 24 : 0; break;
+				}
+			}
+			for (k = 0; k < 4; ++k) {
+				buf[0] = i * 7 + j * 3 + k;
+				buf[1] = k * 5 + j;
+				buf[2] = k;
+				run(buf, 3 + len);
+			}
+		}
+	}
+	free(buf);
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+	if (argc < 2) runall();
+	for (i = 1; i < argc; ++i) runfile(argv[i]);
+	return 0;
+}
+
+#endif
@@ -36,6 +36,47 @@ for i = 1, 10 do
 	assert(zstd.decompress(c) == d)
 end
 
+-----------------------------------
+-- Frame inspection and indexing --
+-----------------------------------
+
+do
+	local t1 = {}
+	local t2 = {}
+	local n = 0
+	for i = 1, 10 do
+		local d = randstr(100000)
+		local c = assert(zstd.compress(d))
+		local h = assert(zstd.getFrameHeader(c))
+		assert(h.frameType == 'frame' and h.frameContentSize == #d and h.dictID == 0 and h.checksumFlag == false)
+		assert(h.headerSize > 0 and h.headerSize < #c and h.windowSize > 0)
+		assert(not math.type or math.type(h.dictID) == 'integer')
+		t1[#t1 + 1] = d
+		t2[#t2 + 1] = c
+		n = n + #d
+	end
+	local skip = string.char(0x50, 0x2a, 0x4d, 0x18, 3, 0, 0, 0) .. 'abc' -- Skippable frame with 3 bytes of user data
+	table.insert(t2, 5, skip)
+	local s = table.concat(t2)
+	local h = assert(zstd.getFrameHeader(skip))
+	assert(h.frameType == 'skippable' and h.frameContentSize == 3)
+	assert(zstd.decompressBound(s) == n)
+	local i = 0
+	for pos, size, type in zstd.frames(s) do
+		i = i + 1
+		assert(s:sub(pos, pos + size - 1) == t2[i])
+		assert(type == (i == 5 and 'skippable' or 'frame'))
+	end
+	assert(i == #t2)
+	local h, e = zstd.getFrameHeader(t1[1])
+	assert(h == nil and e)
+	local n, e = zstd.decompressBound(t1[1])
+	assert(n == nil and e == 'invalid frame data')
+	local ok, e = pcall(function () for _ in zstd.frames(s .. s:sub(1, 3)) do end end)
+	assert(not ok and e:find('position ' .. #s + 1, 1, true))
+	assert(not pcall(function () for _ in zstd.frames(s:sub(1, -2)) do end end))
+end
+
 -----------------------------------------
 -- Streaming compression/decompression --
 -----------------------------------------
@@ -91,6 +132,442 @@ for i = 1, 10 do
 	dctx:reset('all')
 end
 
+-------------------------
+-- Non-blocking stream --
+-------------------------
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+assert(cctx:getNonBlocking() == false)
+cctx:setNonBlocking(true)
+assert(cctx:getNonBlocking() == true)
+pcall(cctx.setParameter, cctx, 'nbWorkers', 2) -- Library may be built without multi-threading support
+cctx:setStats(true)
+for i = 1, 10 do
+	local t1 = {}
+	local t2 = {}
+	local op = i % 2 == 0 and 'flush' or 'continue'
+	for i = 1, 20 do
+		t1[#t1 + 1] = randstr(100000)
+		local data, remaining = cctx:compressStream(t1[#t1], op)
+		assert(data and remaining >= 0)
+		t2[#t2 + 1] = data
+	end
+	repeat -- Drain worker output
+		local data, remaining = cctx:compressStream('', 'end')
+		t2[#t2 + 1] = assert(data)
+	until remaining == 0
+	assert(dctx:decompressStream(table.concat(t2)) == table.concat(t1))
+end
+local stats = cctx:stats()
+assert(stats.growths < stats.calls) -- Only growing output buffer counts
+cctx:setStats(false)
+cctx:reset('params')
+assert(cctx:getNonBlocking() == false)
+assert(select('#', cctx:compressStream('', 'end')) == 1)
+
+--------------------------------
+-- Adaptive compression level --
+--------------------------------
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+cctx:setParameter('compressionLevel', 19)
+cctx:setAdaptive(1, 5)
+local level, hist = cctx:getAdaptive()
+assert(level == 5 and #hist == 1 and hist[1] == 5)
+for i = 1, 10 do
+	local t1 = {}
+	local t2 = {}
+	for i = 1, 10 do
+		t1[#t1 + 1] = randstr(1000)
+		t2[#t2 + 1] = assert(cctx:compressStream(t1[#t1]))
+	end
+	t2[#t2 + 1] = assert(cctx:compressStream('', 'end'))
+	assert(dctx:decompressStream(table.concat(t2)) == table.concat(t1))
+	local level, hist = cctx:getAdaptive()
+	assert(level >= 1 and level <= 5 and level == hist[#hist] and #hist <= 16)
+end
+cctx:setParameter('compressionLevel', 5)
+cctx:setAdaptive(1, 5)
+local t1 = {}
+local t2 = {}
+for i = 1, 40 do -- Single-threaded frame spanning many windows
+	t1[#t1 + 1] = randstr(100000)
+	t2[#t2 + 1] = assert(cctx:compressStream(t1[#t1]))
+	local level, hist = cctx:getAdaptive()
+	assert(level == 5 and #hist == 1) -- Nothing takes effect until the end of frame
+end
+t2[#t2 + 1] = assert(cctx:compressStream('', 'end'))
+assert(dctx:decompressStream(table.concat(t2)) == table.concat(t1))
+local level, hist = cctx:getAdaptive()
+assert(#hist <= 2 and level == hist[#hist] and level >= 4)
+cctx:setAdaptive()
+assert(cctx:getAdaptive() == nil)
+cctx:setAdaptive(-5, -1)
+assert(cctx:getAdaptive() == -1)
+cctx:reset('params')
+assert(cctx:getAdaptive() == nil)
+assert(not pcall(cctx.setAdaptive, cctx, 5, 1))
+
+-----------------------------------
+-- Incompressible data detection --
+-----------------------------------
+
+local function randbytes(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = string.char(math.random(0, 255))
+	end
+	return table.concat(t)
+end
+
+for i = 1, 10 do
+	local d1 = randbytes(math.random(20000, 50000))
+	local d2 = randstr(100000)
+	while #d2 < 10000 do -- Too little data may not be worth compressing
+		d2 = d2 .. randstr(100000)
+	end
+	local c1, m1 = assert(zstd.compress(d1, 19, true))
+	local c2, m2 = assert(zstd.compress(d2, nil, true))
+	assert(m1 == 'stored' and #c1 <= #d1 + 100 and zstd.decompress(c1) == d1)
+	assert(m2 == 'compressed' and #c2 < #d2 and zstd.decompress(c2) == d2)
+	assert(select('#', zstd.compress(d1)) == 1)
+end
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+cctx:setParameter('compressionLevel', 5)
+cctx:setProbe(true)
+assert(cctx:getProbe() == nil)
+for i = 1, 10 do
+	local d = math.random() < 0.5 and randbytes(10000) or randstr(10000)
+	local t = {}
+	t[1] = assert(cctx:compressStream(d:sub(1, 5000)))
+	local m = assert(cctx:getProbe())
+	t[2] = assert(cctx:compressStream(d:sub(5001), 'end'))
+	assert(cctx:getProbe() == m)
+	assert(cctx:getParameter('compressionLevel') == 5) -- Level is restored at the end of frame
+	assert(dctx:decompressStream(table.concat(t)) == d)
+end
+assert(cctx:compressStream(randstr(10000), 'end'))
+assert(cctx:getProbe() == 'compressed' and cctx:getParameter('compressionLevel') == 5)
+cctx:setProbe(false)
+assert(cctx:compressStream(randbytes(10000), 'end'))
+assert(cctx:getProbe() == nil)
+cctx:setProbe(true)
+cctx:setParameter('compressionLevel', 19)
+assert(cctx:compressStream(randbytes(10000)))
+assert(cctx:getProbe() == 'stored' and cctx:getParameter('compressionLevel') < 0)
+local d = ('hello world '):rep(10000)
+assert(#cctx:compress(d) < 1000) -- Stored frame in progress is abandoned
+assert(cctx:getParameter('compressionLevel') == 19)
+assert(cctx:compressStream(randbytes(10000)))
+cctx:reset()
+assert(cctx:getParameter('compressionLevel') == 19)
+cctx:setParameter('compressionLevel', 19)
+assert(cctx:compressStream(randbytes(10000)))
+assert(cctx:getProbe() == 'stored')
+assert(not pcall(cctx.reset, cctx, 'params')) -- Parameters can't be reset mid-frame
+cctx:reset('all')
+assert(cctx:getParameter('compressionLevel') == zstd.CCtx():getParameter('compressionLevel')) -- Back to default
+
+----------------
+-- Statistics --
+----------------
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+zstd.resetStats()
+cctx:setStats(true)
+dctx:setStats(true)
+local n1, n2 = 0, 0
+for i = 1, 10 do
+	local s1 = randstr(10000)
+	local s2 = assert(cctx:compressStream(s1, 'end'))
+	local s3, e = assert(dctx:decompressStream(s2))
+	assert(s1 == s3 and e == 'end')
+	n1 = n1 + #s1
+	n2 = n2 + #s2
+end
+local s = cctx:stats()
+assert(s.bytesIn == n1 and s.bytesOut == n2 and s.calls == 10 and s.frames == 10 and s.growths > 0)
+assert(s.wallTime >= 0 and s.cpuTime >= 0)
+local s = dctx:stats()
+assert(s.bytesIn == n2 and s.bytesOut == n1 and s.calls == 10 and s.frames == 10)
+local s = zstd.stats()
+assert(s.bytesIn == n1 + n2 and s.bytesOut == n1 + n2 and s.calls == 20 and s.frames == 20)
+cctx:resetStats()
+assert(cctx:stats().calls == 0 and zstd.stats().calls == 20)
+cctx:setStats(false)
+assert(cctx:compressStream('abc', 'end'))
+assert(cctx:stats().calls == 0 and zstd.stats().calls == 20)
+zstd.resetStats()
+assert(zstd.stats().calls == 0 and dctx:stats().calls == 10)
+assert(not math.type or math.type(dctx:stats().calls) == 'integer')
+local s = assert(cctx:compressStream('abcdefghijkl', 'end'))
+dctx:resetStats()
+assert(dctx:decompressStream(s .. s) == 'abcdefghijkl') -- Second frame is not consumed
+assert(dctx:stats().bytesIn == #s)
+dctx:resetStats()
+assert(dctx:decompress(s .. s .. s) == ('abcdefghijkl'):rep(3)) -- Content sizes are known
+assert(dctx:stats().frames == 3)
+s = assert(cctx:compressStream('abcdef')) .. assert(cctx:compressStream('ghijkl', 'end'))
+dctx:resetStats()
+assert(dctx:decompress(s .. s) == ('abcdefghijkl'):rep(2)) -- Content sizes are unknown
+assert(dctx:stats().frames == 2)
+
+---------------------------------------------
+-- Whole-payload compression/decompression --
+---------------------------------------------
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+for i = 1, 10 do
+	cctx:setParameter('compressionLevel', math.random(1, 10))
+	cctx:setParameter('checksumFlag', math.random(0, 1))
+	if math.random() < 0.5 then -- Use dictionary
+		local cctxparams = zstd.CCtxParams()
+		cctxparams:set('compressionLevel', 3)
+		cctx:refCDict(zstd.CDict(dict, cctxparams))
+		dctx:refDDict(zstd.DDict(dict))
+	end
+	local t1 = {}
+	local t2 = {}
+	for i = 1, 3 do
+		t1[i] = randstr(100000)
+		t2[i] = assert(cctx:compress(t1[i]))
+		assert(zstd.getFrameContentSize(t2[i]) == #t1[i])
+	end
+	assert(dctx:decompress(table.concat(t2)) == table.concat(t1))
+	assert(cctx:compressStream('abc')) -- Discarded
+	assert(dctx:decompress(assert(cctx:compress(''))) == '')
+	local s, e = dctx:decompress(t1[1])
+	assert(s == nil and e:find('^zstd error'))
+	cctx:reset('all')
+	dctx:reset('all')
+end
+
+local d = ('\0'):rep(1000000) .. randstr(100000)
+local s = assert(cctx:compressStream(d:sub(1, 100))) .. assert(cctx:compressStream(d:sub(101), 'end'))
+assert(zstd.getFrameContentSize(s) == nil) -- Unknown content size
+assert(dctx:decompress(s .. s) == d .. d)
+local s, e = dctx:decompress(s:sub(1, -2))
+assert(s == nil and e)
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+cctx:setParameter('format', 1) -- Magicless frames
+dctx:setParameter('format', 1)
+local d = randstr(10000)
+assert(dctx:decompress(assert(cctx:compress(d))) == d)
+dctx:reset('all')
+local h = string.char(0x28, 0xb5, 0x2f, 0xfd, 0xc0, 0, 0, 0, 0, 0, 0, 1, 0, 0) -- Frame declaring 1 TiB of content
+assert(pcall(dctx.decompress, dctx, h .. string.char(1, 0, 0))) -- Declared size is not allocated
+
+------------------
+-- Context pool --
+------------------
+
+local cctxparams = zstd.CCtxParams()
+cctxparams:set('compressionLevel', 7)
+local pool = zstd.Pool(0, cctxparams)
+local cctx = pool:CCtx()
+local dctx = pool:DCtx()
+assert(cctx:getParameter('compressionLevel') == 7)
+cctx:setParameter('compressionLevel', 1)
+cctx:setProbe(true)
+cctx:setStats(true)
+dctx:setStats(true)
+local d = randstr(100000)
+assert(dctx:decompressStream(assert(cctx:compressStream(d, 'end'))) == d)
+pool:put(cctx)
+pool:put(dctx)
+assert(pool:getMemory() == 0) -- Workspaces freed due to zero budget
+assert(not pcall(pool.put, pool, cctx))
+assert(not pcall(pool.put, pool, cctxparams))
+assert(not pcall(cctx.compressStream, cctx, d)) -- Idle contexts can't be used
+assert(not pcall(dctx.decompress, dctx, d))
+assert(pool:getMemory() == 0)
+assert(pool:CCtx() == cctx and pool:DCtx() == dctx)
+assert(cctx:getParameter('compressionLevel') == 7)
+assert(cctx:stats().calls == 0 and dctx:stats().calls == 0) -- State of previous borrower is cleared
+assert(cctx:compressStream(randbytes(10000)) and cctx:getProbe() == nil)
+cctx:reset()
+assert(dctx:decompressStream(assert(cctx:compressStream(d, 'end'))) == d) -- Workspaces recreated
+
+local pool = zstd.Pool(2 ^ 40)
+local t1 = {}
+local t2 = {}
+for i = 1, 10 do
+	local cctx = pool:CCtx()
+	local dctx = pool:DCtx()
+	local s1 = randstr(10000)
+	local s2 = assert(cctx:compressStream(s1, 'end'))
+	assert(dctx:decompressStream(s2) == s1)
+	t1[i] = cctx
+	t2[i] = dctx
+end
+for i = 1, 10 do
+	pool:put(t1[i])
+	pool:put(t2[i])
+end
+local n = pool:getMemory()
+assert(n > 0)
+pool:trim(n - 1) -- Frees the least recently returned context
+assert(pool:getMemory() < n and pool:getMemory() > 0)
+for i = 10, 1, -1 do
+	assert(pool:CCtx() == t1[i])
+end
+pool:trim()
+assert(pool:getMemory() == 0)
+pool:put(pool:DCtx())
+assert(pool:getMemory() == 0) -- Freed workspaces are not recreated just to be reset
+
+--------------------------
+-- Sequence compression --
+--------------------------
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+
+for i = 1, 10 do
+	local d = randstr(300000)
+	d = d .. d
+	cctx:setParameter('compressionLevel', math.random(1, 10))
+	local seqs = assert(cctx:generateSequences(d))
+	local n, m = #seqs, 0
+	assert(n > 0)
+	assert(#cctx:compress(('hello world '):rep(10000)) < 1000) -- Context isn't affected by match finding
+	for i = 1, n do
+		local of, ll, ml, rep = seqs:get(i)
+		assert(of >= 0 and ll >= 0 and ml >= 0 and rep >= 0 and rep <= 3)
+		m = m + ll + ml
+	end
+	assert(m == #d)
+	assert(not pcall(seqs.get, seqs, n + 1))
+	assert(not pcall(cctx.compressSequences, cctx, seqs)) -- Block delimiters mismatch
+	cctx:setParameter('blockDelimiters', 1)
+	for level = 1, 19, 6 do
+		cctx:setParameter('compressionLevel', level)
+		assert(dctx:decompress(assert(cctx:compressSequences(seqs))) == d)
+	end
+	seqs:mergeBlockDelimiters()
+	assert(#seqs < n)
+	cctx:setParameter('blockDelimiters', 0)
+	assert(dctx:decompress(assert(cctx:compressSequences(seqs))) == d)
+	cctx:reset('all')
+end
+
+-----------------------
+-- Chunked archiving --
+-----------------------
+
+local function chunk(chunker, data)
+	local t = {}
+	local i = 1
+	while i <= #data do
+		local n = math.random(1, 10000)
+		for _, c in ipairs(chunker:write(data:sub(i, i + n - 1))) do
+			t[#t + 1] = c
+		end
+		i = i + n
+	end
+	for _, c in ipairs(chunker:finish()) do
+		t[#t + 1] = c
+	end
+	return t
+end
+
+local cctx = zstd.CCtx()
+local dctx = zstd.DCtx()
+local index = {}
+local opts = {minSize = 1000, avgSize = 1024, maxSize = 5000, index = index}
+
+local d1 = randstr(100000)
+while #d1 < 100000 do -- Enough chunks around the change
+	d1 = d1 .. randstr(100000)
+end
+local d2 = d1:sub(1, 50000) .. 'xyz' .. d1:sub(50001)
+local t1 = chunk(zstd.Chunker(cctx, opts), d1)
+local t2 = chunk(zstd.Chunker(cctx, opts), d2)
+local t3 = chunk(zstd.Chunker(cctx, {minSize = 1000, avgSize = 1024, maxSize = 5000, dedup = false}), d1)
+local n, m = 0, 0
+local s = {}
+for i, c in ipairs(t1) do
+	assert(c.frame and c.size >= 1000 and c.size <= 5000 or i == #t1)
+	assert(#c.digest == 32 and index[c.digest] == c.size)
+	assert(t3[i].frame == c.frame and t3[i].digest == c.digest) -- Boundaries depend on content only
+	s[i] = c.frame
+	n = n + c.size
+end
+assert(n == #d1 and #t1 == #t3)
+assert(dctx:decompress(table.concat(s)) == d1)
+for _, c in ipairs(t2) do
+	if c.frame then
+		m = m + 1
+	end
+end
+assert(m > 0 and m * 4 <= #t2) -- Only chunks around the change are new
+
+local t4 = zstd.Chunker(cctx):finish() -- Empty input
+assert(#t4 == 0)
+t4 = zstd.Chunker(cctx, {index = {}}):write('abc')
+assert(#t4 == 0)
+local function hex(s)
+	return (s:gsub('.', function (c) return string.format('%02x', c:byte()) end))
+end
+local c = zstd.Chunker(cctx) -- SHA-256 test vector
+c:write('abc')
+c = c:finish()[1]
+assert(hex(c.digest) == 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad' and c.frame)
+index = {[c.digest] = 4} -- Size mismatch is not a reference
+c = zstd.Chunker(cctx, {index = index})
+c:write('abc')
+c = c:finish()[1]
+assert(c.frame and index[c.digest] == 3)
+d1 = (randstr(3000) .. ('.'):rep(3000)):sub(1, 3000)
+index = {}
+c = zstd.Chunker(cctx, {minSize = 3000, maxSize = 3000, index = index})
+t4 = c:write(d1 .. d1) -- Repeated chunk within a single call
+assert(#t4 == 2 and t4[1].frame and not t4[2].frame and index[t4[1].digest] == 3000)
+
+----------------------------
+-- Compression autotuning --
+----------------------------
+
+local t = {}
+for i = 1, 10 do
+	t[i] = randstr(10000)
+end
+for _, target in ipairs{'ratio', 'speed'} do
+	local cctxparams, frontier = zstd.tune(t, {target = target, time = 0.5})
+	assert(#frontier > 0)
+	for i = 2, #frontier do
+		assert(frontier[i].speed <= frontier[i - 1].speed and frontier[i].ratio > frontier[i - 1].ratio)
+	end
+	local best = frontier[target == 'speed' and 1 or #frontier]
+	assert(cctxparams:get('strategy') == best.strategy and cctxparams:get('windowLog') == best.windowLog)
+	local cctx = zstd.CCtx()
+	cctx:setParameters(cctxparams)
+	local s = table.concat(t)
+	assert(zstd.decompress(assert(cctx:compress(s))) == s)
+end
+for _, opts in ipairs{{target = 'ratio', minSpeed = 1e9}, {target = 'speed', minRatio = 1e9}} do -- Unreachable constraints
+	opts.time = 0.5
+	local cctxparams, frontier = zstd.tune(t, opts)
+	local best = frontier[opts.minSpeed and 1 or #frontier] -- Closest to failing constraint
+	assert(cctxparams:get('strategy') == best.strategy and cctxparams:get('windowLog') == best.windowLog)
+end
+assert(zstd.tune(t[1], {time = 0}))
+assert(not pcall(zstd.tune, {}))
+assert(not pcall(zstd.tune, t, {target = 'foo'}))
+assert(not pcall(zstd.tune, t, {time = -1}))
+
 -----------------------------------------
 -- Stateless compression/decompression --
 -----------------------------------------